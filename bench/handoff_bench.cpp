@@ -0,0 +1,155 @@
+// handoff_bench.cpp
+// Cost of passing an accepted connection to a worker: hand_off() pushes
+// onto the worker's BoundedQueue<Handoff> and signals its eventfd, and the
+// worker wakes from epoll_wait and registers it in adopt_connections().
+// Socketpairs stand in for accepted connections.
+//
+//   bench/handoff_bench [producers] [rounds] [round_size] [latency_samples]
+//
+// Latency is one connection at a time from hand_off() until
+// adopt_connections() has returned on the worker (this thread); throughput
+// is `producers` threads handing off `round_size` connections per round as
+// fast as the queue takes them. `make handoff-bench` runs it with the
+// defaults.
+#include "worker.h"
+#include "config.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// Blocks in epoll_wait on the eventfd like worker_loop, then adopts
+static void wait_and_adopt(Worker& w) {
+    epoll_event ev;
+    while (epoll_wait(w.epfd, &ev, 1, -1) < 0) {}
+    uint64_t count;
+    ssize_t n = read(w.evfd, &count, sizeof(count)); // as handle_storage_acks does
+    (void)n;
+    adopt_connections(w);
+}
+
+// Connections and their peer ends, created outside the timed part
+static std::vector<int> make_pairs(size_t count, std::vector<int>& peers) {
+    std::vector<int> fds;
+    for (size_t i = 0; i < count; ++i) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+            std::perror("socketpair");
+            std::exit(1);
+        }
+        fds.push_back(sv[0]);
+        peers.push_back(sv[1]);
+    }
+    return fds;
+}
+
+static void close_all(Worker& w, const std::vector<int>& fds, std::vector<int>& peers) {
+    for (int fd : fds) close_connection(w, fd);
+    for (int fd : peers) close(fd);
+    peers.clear();
+}
+
+static double percentile(std::vector<double>& v, double p) {
+    size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int main(int argc, char** argv) {
+    int producers = argc > 1 ? std::atoi(argv[1]) : 4;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 200;
+    int roundSize = argc > 3 ? std::atoi(argv[3]) : 256;
+    int samples = argc > 4 ? std::atoi(argv[4]) : 20000;
+    if (producers < 1 || rounds < 1 || roundSize < 1 || samples < 1) {
+        std::fprintf(stderr, "usage: %s [producers] [rounds] [round_size] [latency_samples]\n", argv[0]);
+        return 2;
+    }
+
+    // One worker set up as main() does, driven from this thread
+    Worker w;
+    w.epfd = epoll_create1(0);
+    w.evfd = eventfd(0, EFD_NONBLOCK);
+    w.incoming = std::make_unique<BoundedQueue<Handoff>>(g_config.handoff_queue_size);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = w.evfd;
+    if (w.epfd < 0 || w.evfd < 0 || epoll_ctl(w.epfd, EPOLL_CTL_ADD, w.evfd, &ev) < 0) {
+        std::perror("epoll/eventfd");
+        return 1;
+    }
+    w.now = Clock::now();
+    std::printf("%d producers, %d rounds of %d, %d latency samples, queue %d\n",
+                producers, rounds, roundSize, samples, g_config.handoff_queue_size);
+
+    // Latency: one handoff in flight; the producer waits for its adoption
+    std::vector<int> peers;
+    std::vector<double> latency;
+    latency.reserve(samples);
+    {
+        std::atomic<int> adopted{0};
+        std::atomic<int64_t> sentAt{0};
+        std::atomic<int> sentFd{-1};
+        std::thread producer([&] {
+            for (int i = 0; i < samples; ++i) {
+                int sv[2];
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) std::abort();
+                sentFd.store(sv[0], std::memory_order_relaxed);
+                sentAt.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                while (!hand_off(w, sv[0], "192.0.2.1")) std::this_thread::yield();
+                while (adopted.load(std::memory_order_acquire) <= i) std::this_thread::yield();
+                close(sv[1]); // open till adopted, or the banner would fail to send
+            }
+        });
+        for (int i = 0; i < samples;) {
+            wait_and_adopt(w);
+            if (w.conns.size() == 0) continue;
+            auto done = Clock::now().time_since_epoch().count();
+            latency.push_back((done - sentAt.load(std::memory_order_relaxed)) / 1e3);
+            close_connection(w, sentFd.load(std::memory_order_relaxed));
+            adopted.store(++i, std::memory_order_release);
+        }
+        producer.join();
+    }
+    std::printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+                percentile(latency, 0.5), percentile(latency, 0.9), percentile(latency, 0.99),
+                *std::max_element(latency.begin(), latency.end()));
+
+    // Throughput: producers race to fill the queue while this thread adopts
+    std::chrono::duration<double> busy{0};
+    std::atomic<uint64_t> queueFull{0};
+    for (int r = 0; r < rounds; ++r) {
+        std::vector<int> fds = make_pairs(roundSize, peers);
+        std::atomic<bool> go{false};
+        std::vector<std::thread> pool;
+        for (int p = 0; p < producers; ++p) {
+            pool.emplace_back([&, p] {
+                uint64_t full = 0;
+                while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+                for (size_t i = p; i < fds.size(); i += producers) {
+                    while (!hand_off(w, fds[i], "192.0.2.1")) { ++full; std::this_thread::yield(); }
+                }
+                queueFull += full;
+            });
+        }
+        auto t0 = Clock::now();
+        go.store(true, std::memory_order_release);
+        while (w.conns.size() < fds.size()) wait_and_adopt(w);
+        busy += Clock::now() - t0;
+        for (auto& t : pool) t.join();
+        close_all(w, fds, peers);
+    }
+    double total = static_cast<double>(rounds) * roundSize;
+    std::printf("throughput: %.0f handoffs/s (%.0f handoffs, %llu pushes found the queue full)\n",
+                total / busy.count(), total, static_cast<unsigned long long>(queueFull.load()));
+    return 0;
+}
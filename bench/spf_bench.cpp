@@ -0,0 +1,131 @@
+// spf_bench.cpp
+// Load test for spf::check_host against an in-process ZoneResolver, so SPF
+// throughput and cache behaviour can be measured without a network.
+// Builds a zone of synthetic sender domains, checks each once with cold
+// caches, then runs random (domain, ip) checks from several threads.
+//
+//   bench/spf_bench [domains] [threads] [seconds] [latency_us] [cache_size]
+//
+// `make spf-bench` runs it with the defaults.
+#include "spf_check.h"
+#include "dns_resolver.h"
+#include "config.h"
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Sender domain i gets one of four policy shapes (ip4, mx, a, redirect),
+// three of them through include: or redirect= to a shared relay policy
+static void write_zone(const std::string& path, int domains) {
+    std::ofstream z(path);
+    z << "relay.bench 3600 TXT \"v=spf1 ip4:192.0.2.0/24 ip6:2001:db8::/32 -all\"\n";
+    for (int i = 0; i < domains; ++i) {
+        std::string d = "d" + std::to_string(i) + ".bench";
+        std::string net = "10." + std::to_string(i / 256 % 256) + "." + std::to_string(i % 256);
+        switch (i % 4) {
+            case 0: z << d << " TXT \"v=spf1 ip4:" << net << ".0/24 -all\"\n"; break;
+            case 1: z << d << " TXT \"v=spf1 mx include:relay.bench -all\"\n"; break;
+            case 2: z << d << " TXT \"v=spf1 a include:relay.bench ~all\"\n"; break;
+            case 3: z << d << " TXT \"v=spf1 redirect=relay.bench\"\n"; break;
+        }
+        z << d << " MX 10 mx." << d << "\n";
+        z << "mx." << d << " A " << net << ".25\n";
+        z << d << " A " << net << ".1\n";
+    }
+}
+
+// About half the checks come from an address the domain authorises: its
+// own host or the relay block
+static std::string client_ip(std::mt19937& rng, int domain) {
+    std::string net = "10." + std::to_string(domain / 256 % 256) + "." + std::to_string(domain % 256);
+    switch (rng() % 4) {
+        case 0: return net + (domain % 4 == 2 ? ".1" : ".25");
+        case 1: return "192.0.2." + std::to_string(rng() % 256);
+        default: return "203.0.113." + std::to_string(rng() % 256);
+    }
+}
+
+static double hit_rate(uint64_t hits, uint64_t misses) {
+    return hits + misses ? 100.0 * hits / (hits + misses) : 0;
+}
+
+int main(int argc, char** argv) {
+    int domains = argc > 1 ? std::atoi(argv[1]) : 10000;
+    int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+    int seconds = argc > 3 ? std::atoi(argv[3]) : 5;
+    int latency = argc > 4 ? std::atoi(argv[4]) : 0;
+    if (argc > 5) g_config.spf_cache_size = std::atoi(argv[5]);
+    if (domains < 1 || threads < 1 || seconds < 1) {
+        std::fprintf(stderr, "usage: %s [domains] [threads] [seconds] [latency_us] [cache_size]\n", argv[0]);
+        return 2;
+    }
+
+    char path[] = "/tmp/spf_bench_zone_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { std::perror("mkstemp"); return 1; }
+    close(fd);
+    write_zone(path, domains);
+    auto zone = std::make_unique<spf::ZoneResolver>(latency);
+    bool loaded = zone->load(path);
+    unlink(path);
+    if (!loaded) return 1;
+    spf::set_resolver(std::move(zone));
+
+    std::printf("%d domains, %d threads, %d us per query, cache %d entries\n",
+                domains, threads, latency, g_config.spf_cache_size);
+
+    // Cold: every domain once, every lookup a cache miss
+    std::mt19937 rng(1);
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < domains; ++i) spf::check_host("d" + std::to_string(i) + ".bench", client_ip(rng, i));
+    std::chrono::duration<double> cold = std::chrono::steady_clock::now() - t0;
+    std::printf("cold:   %10.0f checks/s\n", domains / cold.count());
+
+    // Warm: random domains and addresses until the time is up
+    spf::CacheStats before = spf::cache_stats();
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> checks{0};
+    std::vector<std::atomic<uint64_t>> byResult(static_cast<size_t>(spf::Result::PermError) + 1);
+    std::vector<std::thread> pool;
+    t0 = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            std::mt19937 r(100 + t);
+            uint64_t n = 0;
+            std::vector<uint64_t> local(byResult.size());
+            while (!stop.load(std::memory_order_relaxed)) {
+                int d = static_cast<int>(r() % domains);
+                spf::Result res = spf::check_host("d" + std::to_string(d) + ".bench", client_ip(r, d));
+                ++local[static_cast<size_t>(res)];
+                ++n;
+            }
+            checks += n;
+            for (size_t i = 0; i < local.size(); ++i) byResult[i] += local[i];
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto& th : pool) th.join();
+    std::chrono::duration<double> warm = std::chrono::steady_clock::now() - t0;
+    spf::CacheStats after = spf::cache_stats();
+
+    std::printf("warm:   %10.0f checks/s (%llu checks)\n", checks / warm.count(),
+                static_cast<unsigned long long>(checks.load()));
+    for (size_t i = 0; i < byResult.size(); ++i) {
+        if (byResult[i]) std::printf("  %-10s %llu\n", spf::result_name(static_cast<spf::Result>(i)),
+                                     static_cast<unsigned long long>(byResult[i].load()));
+    }
+    std::printf("cache hit rates while warm: policy %.1f%%, address %.1f%%, mx %.1f%%\n",
+                hit_rate(after.policy_hits - before.policy_hits, after.policy_misses - before.policy_misses),
+                hit_rate(after.address_hits - before.address_hits, after.address_misses - before.address_misses),
+                hit_rate(after.mx_hits - before.mx_hits, after.mx_misses - before.mx_misses));
+    return 0;
+}
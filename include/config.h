@@ -3,7 +3,35 @@
 
 #include <string>
 
+// When a DATA transaction is acknowledged with 250
+enum class AckMode {
+    Commit,   // after the database commit (or the spool write if the DB is down)
+    Spool     // as soon as the message is durable in the spool
+};
+
+// What MAIL FROM does with an SPF result
+enum class SpfAction {
+    Accept,
+    TempFail,  // 451, the client retries later
+    Reject     // 550
+};
+
 // Struct holding all config values
+enum class LogLevel {
+    Debug,
+    Info,
+    Warn,
+    Error,
+    Off
+};
+
+// How a new connection picks its worker
+enum class DispatchPolicy {
+    RoundRobin,   // acceptor: next worker in turn; reuseport: the accepting worker
+    LeastLoaded,  // lowest load score over all workers
+    PowerOfTwo    // lower score of two workers sampled at random
+};
+
 struct Config {
     int port;
     int backlog;
@@ -11,6 +39,47 @@ struct Config {
     int workers;
     int buf_sz;
     std::string db_conn_str;
+    int db_pool_size;          // 0 = one connection per storage thread
+    int db_health_check_secs;  // idle time before a pooled connection is pinged
+    int storage_threads;       // threads writing accepted messages to the DB
+    int storage_queue_size;    // max messages waiting for a storage thread
+    AckMode storage_ack;
+    int db_batch_max;          // messages written per transaction
+    int db_batch_linger_ms;    // wait for a batch to fill after its first message
+    int attachment_cache_size; // recently stored attachment hashes kept in memory
+    std::string spool_dir;     // empty = spool disabled
+    int spool_segment_mb;      // rotate segment files at this size
+    int spool_fsync_ms;        // group-commit linger before each fsync
+    int spool_replay_secs;     // retry interval while the DB is down
+    int spf_threads;           // threads running SPF checks off the epoll workers
+    int spf_queue_size;        // max MAIL FROM checks waiting for an SPF thread
+    int spf_cache_size;        // cached SPF records / A / MX answers (each)
+    int spf_negative_ttl_secs; // how long failed or empty lookups are cached
+    SpfAction spf_on_none;     // per-result policy (pass always accepts)
+    SpfAction spf_on_neutral;
+    SpfAction spf_on_softfail;
+    SpfAction spf_on_fail;
+    SpfAction spf_on_temperror;
+    SpfAction spf_on_permerror;
+    std::string dns_resolver;  // "system", or "zone" to answer SPF lookups from dns_zone_file
+    std::string dns_zone_file;
+    int dns_mock_latency_us;   // simulated round trip per query (zone resolver only)
+    std::string accept_mode;   // "reuseport" (listener per worker) or "acceptor" (one accepting thread)
+    int handoff_queue_size;    // accepted connections waiting for each worker to adopt them
+    DispatchPolicy dispatch_policy;
+    LogLevel log_level;        // records below this level are not formatted
+    bool log_protocol;         // trace every SMTP command and reply
+    std::string log_file;      // empty = stderr
+    long long max_message_size; // SIZE limit in bytes, advertised in EHLO
+    int memory_budget_mb;      // buffered session data across all workers (0 = unlimited)
+    int greeting_timeout_secs; // banner to HELO/EHLO (0 = no timeout, likewise below)
+    int command_timeout_secs;  // waiting for the next command inside a mail transaction
+    int data_timeout_secs;     // between reads of DATA or BDAT message text
+    int idle_timeout_secs;     // waiting for a command between transactions
+    std::string event_loop;    // "epoll", or "io_uring" (falls back to epoll where unsupported)
+    int uring_buffers;         // provided receive buffers per io_uring worker, buf_sz bytes each
+    int metrics_port;          // Prometheus scrape endpoint (0 = disabled)
+    std::string metrics_bind;  // address it listens on
 };
 
 // Global instance accessible everywhere
@@ -0,0 +1,75 @@
+#ifndef DB_POOL_H
+#define DB_POOL_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include "postgres.h"
+
+// Fixed-size pool of PostgresDB connections.
+//
+// Each caller passes an affinity hint (its worker id); the hint maps to a
+// home slot so that with db_pool_size >= workers every worker owns its own
+// connection and never waits. Connections found broken are reopened (and
+// their prepared statements re-registered) on the next acquire.
+class DbPool {
+public:
+    // RAII handle on one pooled connection. Rolls back any transaction left
+    // open and returns the slot to the pool when destroyed.
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease();
+
+        PostgresDB& db() const;
+        explicit operator bool() const { return pool != nullptr; }
+
+        // Flags the connection as unusable; it is reopened before reuse.
+        void markBroken();
+
+    private:
+        friend class DbPool;
+        Lease(DbPool* pool, size_t slot) : pool(pool), slot(slot) {}
+        void release();
+
+        DbPool* pool = nullptr;
+        size_t slot = 0;
+    };
+
+    DbPool(const std::string& connectionStr, int size, int healthCheckSecs);
+
+    // Opens every connection and prepares statements. Returns false if
+    // none of them could be established.
+    bool init();
+
+    // Blocks until a connection is available. Throws std::runtime_error if
+    // the chosen connection is down and cannot be reopened.
+    Lease acquire(int affinity);
+
+    size_t size() const { return slots.size(); }
+
+private:
+    struct Slot {
+        std::mutex mtx;
+        std::unique_ptr<PostgresDB> db;
+        bool broken = false;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    bool ensureHealthy(Slot& s);
+
+    std::string connStr;
+    std::chrono::seconds healthInterval;
+    std::vector<std::unique_ptr<Slot>> slots;
+};
+
+// Global pool shared by all workers
+extern DbPool* g_db_pool;
+
+#endif // DB_POOL_H
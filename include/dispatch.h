@@ -0,0 +1,15 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <vector>
+#include "types.h"
+
+// Remembers the worker set the dispatcher chooses from.
+void dispatch_init(std::vector<Worker>& workers);
+
+// Worker for a new connection under g_config.dispatch_policy. `local` is
+// the worker that accepted it (reuseport mode), nullptr for the acceptor
+// thread. Returns `local` itself unless another worker is less loaded.
+Worker& pick_worker(Worker* local);
+
+#endif // DISPATCH_H
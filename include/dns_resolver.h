@@ -0,0 +1,81 @@
+#ifndef DNS_RESOLVER_H
+#define DNS_RESOLVER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "spf_policy.h"
+
+namespace spf {
+
+// Records of one type for one name. An empty answer without temp_error is
+// NXDOMAIN or NODATA (a "void lookup" in RFC 7208 terms).
+template <typename T>
+struct DnsAnswer {
+    std::vector<T> values;
+    uint32_t ttl = 0;          // smallest TTL of the answer records
+    bool temp_error = false;   // SERVFAIL, timeout or other server error
+};
+
+// The DNS queries SPF evaluation needs. Implementations must be safe to
+// call from several SPF threads at once.
+class Resolver {
+public:
+    virtual ~Resolver() = default;
+    virtual DnsAnswer<std::string> txt(const std::string& name) = 0;
+    virtual DnsAnswer<IpAddr> addresses(const std::string& name) = 0;  // A and AAAA
+    virtual DnsAnswer<std::string> mx(const std::string& name) = 0;    // exchange host names
+};
+
+// glibc res_query against the system's configured name servers
+class SystemResolver : public Resolver {
+public:
+    DnsAnswer<std::string> txt(const std::string& name) override;
+    DnsAnswer<IpAddr> addresses(const std::string& name) override;
+    DnsAnswer<std::string> mx(const std::string& name) override;
+};
+
+// In-process resolver answering from a zone file, for offline testing and
+// load tests. Each query sleeps `latency_us` to stand in for a round trip.
+//
+// One record per line: `name [ttl] [IN] type data`, with ';' or '#'
+// comments. Types: A, AAAA, MX (`pref host`), TXT (one or more quoted
+// strings, concatenated), and SERVFAIL (no data; queries for the name
+// fail with a temporary error).
+class ZoneResolver : public Resolver {
+public:
+    explicit ZoneResolver(int latency_us = 0) : latency_us(latency_us) {}
+
+    // Loads (or adds) records; false if the file cannot be read or a line
+    // is malformed (reported on stderr)
+    bool load(const std::string& path);
+
+    DnsAnswer<std::string> txt(const std::string& name) override;
+    DnsAnswer<IpAddr> addresses(const std::string& name) override;
+    DnsAnswer<std::string> mx(const std::string& name) override;
+
+private:
+    struct Node {
+        DnsAnswer<std::string> txt;
+        DnsAnswer<IpAddr> addrs;
+        DnsAnswer<std::string> mx;
+        bool servfail = false;
+    };
+
+    template <typename T>
+    DnsAnswer<T> lookup(const std::string& name, DnsAnswer<T> Node::*field, int queries);
+
+    int latency_us;
+    std::unordered_map<std::string, Node> zone;   // lower-cased, no trailing dot
+};
+
+// The resolver used by check_host (a SystemResolver unless replaced).
+// Replace it only at startup, before SPF threads run.
+Resolver& resolver();
+void set_resolver(std::unique_ptr<Resolver> r);
+
+} // namespace spf
+
+#endif // DNS_RESOLVER_H
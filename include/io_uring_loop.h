@@ -0,0 +1,33 @@
+#ifndef IO_URING_LOOP_H
+#define IO_URING_LOOP_H
+
+#include <string>
+#include "types.h"
+
+// io_uring worker backend (event_loop=io_uring), driven with raw syscalls.
+// Each worker owns one ring: a multishot accept on its listener, a multishot
+// poll on its eventfd, one multishot recv per session filling buffers from a
+// provided buffer ring, and at most one send per session in flight carrying
+// every reply queued since the previous one. A loop pass submits and waits
+// with a single io_uring_enter however many sessions it served.
+
+// True if the running kernel has what the backend needs (6.0 or later:
+// provided buffer rings and multishot recv)
+bool uring_supported();
+
+// Runs the worker on io_uring; falls back to worker_loop if its ring cannot
+// be set up
+void uring_worker_loop(Worker* wptr, int id);
+
+// Called by the session code while w.ring is set:
+// Starts (or resumes) receiving for a session
+void uring_watch(Worker& w, int fd);
+// Stops receiving until uring_watch (memory budget)
+void uring_pause_reads(Worker& w, int fd);
+// Sends `out` (which is emptied); the session's wantWrite stays set until
+// it has all been written, then handle_writable runs
+void uring_send(Worker& w, int fd, std::string& out);
+// Cancels the session's requests; fd is closed once they have completed
+void uring_close(Worker& w, int fd);
+
+#endif // IO_URING_LOOP_H
@@ -0,0 +1,55 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <string>
+#include "config.h"
+
+// Asynchronous logger. Each thread queues formatted records on its own
+// lock-free ring; one background thread timestamps them and writes them in
+// batches. Records below g_config.log_level are never formatted. A full
+// ring drops the record (and counts it) rather than stall the caller.
+
+// Starts the writer thread. Records logged before this are written
+// synchronously; anything queued at exit is flushed.
+void log_start();
+
+bool log_enabled(LogLevel level);
+void log_write(LogLevel level, std::string&& text);
+
+// SMTP protocol trace (C:/S: lines), enabled by log_protocol
+inline bool log_protocol_enabled() { return g_config.log_protocol; }
+
+#define LOG_AT(level, expr)                              \
+    do {                                                 \
+        if (log_enabled(level)) {                        \
+            std::ostringstream log_os_;                  \
+            log_os_ << expr;                             \
+            log_write(level, log_os_.str());             \
+        }                                                \
+    } while (0)
+
+#define LOG_DEBUG(expr) LOG_AT(LogLevel::Debug, expr)
+#define LOG_INFO(expr)  LOG_AT(LogLevel::Info, expr)
+#define LOG_WARN(expr)  LOG_AT(LogLevel::Warn, expr)
+#define LOG_ERROR(expr) LOG_AT(LogLevel::Error, expr)
+
+// perror() replacement: `what: strerror(errno)` at error level
+#define LOG_ERRNO(what)                                              \
+    do {                                                             \
+        int log_errno_ = errno;                                      \
+        LOG_AT(LogLevel::Error, what << ": " << std::strerror(log_errno_)); \
+    } while (0)
+
+#define LOG_PROTOCOL(expr)                                           \
+    do {                                                             \
+        if (log_protocol_enabled()) {                                \
+            std::ostringstream log_os_;                              \
+            log_os_ << expr;                                         \
+            log_write(LogLevel::Info, log_os_.str());                \
+        }                                                            \
+    } while (0)
+
+#endif // LOGGER_H
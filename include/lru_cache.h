@@ -0,0 +1,56 @@
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Thread-safe fixed-capacity LRU map. get() refreshes recency; put()
+// evicts the least recently used entry once capacity is reached.
+template <typename K, typename V>
+class LruCache {
+public:
+    explicit LruCache(size_t capacity) : capacity(capacity) {}
+
+    bool get(const K& key, V& out) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+        order.splice(order.begin(), order, it->second);
+        out = it->second->second;
+        return true;
+    }
+
+    void put(const K& key, const V& value) {
+        if (capacity == 0) return;
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->second = value;
+            order.splice(order.begin(), order, it->second);
+            return;
+        }
+        if (index.size() >= capacity) {
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+        order.emplace_front(key, value);
+        index[key] = order.begin();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lk(mtx);
+        index.clear();
+        order.clear();
+    }
+
+private:
+    size_t capacity;
+    std::mutex mtx;
+    std::list<std::pair<K, V>> order;   // most recent first
+    std::unordered_map<K, typename std::list<std::pair<K, V>>::iterator> index;
+};
+
+#endif // LRU_CACHE_H
@@ -0,0 +1,92 @@
+#ifndef MESSAGE_VIEW_H
+#define MESSAGE_VIEW_H
+
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mail {
+
+struct HeaderField {
+    std::string_view name;   // as written
+    std::string_view value;  // raw; spans continuation lines if folded
+};
+
+// Flat header table of string_view slices. The first kInline fields are
+// stored in place, so typical messages parse without touching the heap.
+class HeaderTable {
+public:
+    static constexpr size_t kInline = 32;
+
+    void add(std::string_view name, std::string_view value);
+    void clear();
+    size_t size() const { return count; }
+    const HeaderField& operator[](size_t i) const {
+        return i < kInline ? inlineFields[i] : overflow[i - kInline];
+    }
+
+    // Last field called `name` (case-insensitive), or null. A repeated
+    // header overrides earlier ones, as the old map-based parser did.
+    const HeaderField* find(std::string_view name) const;
+    bool has(std::string_view name) const { return find(name) != nullptr; }
+    // Raw value, or an empty view if absent
+    std::string_view raw(std::string_view name) const;
+    // Replaces the value of field i (used to widen folded headers)
+    void setValue(size_t i, std::string_view value) { at(i).value = value; }
+
+private:
+    HeaderField& at(size_t i) { return i < kInline ? inlineFields[i] : overflow[i - kInline]; }
+
+    std::array<HeaderField, kInline> inlineFields;
+    std::vector<HeaderField> overflow;
+    size_t count = 0;
+};
+
+// Parses a header block (everything before the blank line) into `out`.
+// Handles CRLF or LF line ends and folded continuation lines.
+void parseHeaderBlock(std::string_view block, HeaderTable& out);
+
+// Joins folded lines with single spaces (allocates; call only when needed).
+std::string unfold(std::string_view value);
+
+// Splits an entity at its first blank line. Without one, it is all headers.
+void splitEntity(std::string_view entity, std::string_view& headers, std::string_view& body);
+
+// One leaf MIME part; body is still transfer-encoded
+struct PartView {
+    HeaderTable headers;
+    std::string_view body;   // leading/trailing blank lines trimmed
+};
+
+// Zero-copy view of a whole message. Headers, parts and undecoded bodies
+// are slices of one buffer, which the view either owns or borrows.
+class MessageView {
+public:
+    // Takes ownership of the message buffer
+    explicit MessageView(std::string buffer);
+    // Refers to a buffer the caller keeps alive
+    static MessageView borrow(std::string_view buffer);
+
+    std::string_view buffer() const { return data; }
+    const HeaderTable& headers() const { return top; }
+    std::string_view body() const { return topBody; }
+    // Leaf parts in document order (multipart containers are flattened)
+    const std::vector<PartView>& parts() const { return leaves; }
+
+private:
+    MessageView() = default;
+    void parse();
+    void walk(const HeaderTable& headers, std::string_view body, int depth);
+
+    std::unique_ptr<const std::string> owned;  // heap-pinned so views stay valid on move
+    std::string_view data;
+    HeaderTable top;
+    std::string_view topBody;
+    std::vector<PartView> leaves;
+};
+
+} // namespace mail
+
+#endif // MESSAGE_VIEW_H
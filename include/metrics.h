@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "types.h"
+
+// Process-wide counters and latency histograms. Every thread records into
+// its own shard, so recording is a plain load and store on memory no other
+// thread writes: no locks and no atomic read-modify-write. A scrape sums
+// the shards. Gauges (sessions, queues, caches) are read from their owners
+// when a scrape renders them.
+namespace metrics {
+
+enum Counter {
+    kConnectionsAccepted,     // sessions started
+    kConnectionsRefused,      // acceptor found every handoff queue full
+    kConnectionsTimedOut,
+    kBytesReceived,
+    kMessagesAccepted,        // storage outcome of DATA/BDAT
+    kMessagesTempFailed,
+    kMessagesRejected,
+    kMailRefusedSize,         // 552 at MAIL FROM or after DATA
+    kMailRefusedBudget,       // 452 while over memory_budget_mb
+    kSpfNone,                 // SPF results, in spf::Result order
+    kSpfNeutral,
+    kSpfPass,
+    kSpfFail,
+    kSpfSoftFail,
+    kSpfTempError,
+    kSpfPermError,
+    kDbRollbacks,
+    kSpoolDeadLetters,        // accepted messages the database refused for good
+    kLogDropped,
+    kCounterCount
+};
+
+enum Histogram {
+    kReadBatch,               // one readiness event: receive, run commands, queue replies
+    kSpfCheck,                // check_host, DNS included
+    kParse,                   // whole-message MIME parse (mail::Parser::parse)
+    kDbTransaction,           // begin to commit
+    kHistogramCount
+};
+
+void add(Counter c, uint64_t n = 1);
+void observe(Histogram h, std::chrono::nanoseconds elapsed);
+
+// Observes the time from construction to destruction
+class Timer {
+public:
+    explicit Timer(Histogram h) : h(h), start(std::chrono::steady_clock::now()) {}
+    ~Timer() { observe(h, std::chrono::steady_clock::now() - start); }
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+private:
+    Histogram h;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Everything in the Prometheus text format (version 0.0.4)
+std::string render();
+
+// Serves GET /metrics on metrics_bind:metrics_port from its own thread.
+// No-op when metrics_port is 0. `workers` supplies the per-worker gauges.
+void start(std::vector<Worker>& workers);
+
+} // namespace metrics
+
+#endif // METRICS_H
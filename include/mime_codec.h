@@ -0,0 +1,36 @@
+#ifndef MIME_CODEC_H
+#define MIME_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace mail {
+
+// Bits of an unfinished base64 quantum carried between calls, so a body can
+// be decoded line by line as it streams in.
+struct Base64State {
+    uint32_t val = 0;
+    int bits = -8;
+};
+
+// Appends the decoded bytes of `in` to `out`. Permissive like the original
+// scalar decoder: line breaks, padding and any non-alphabet byte are skipped.
+// Runs of clean input are decoded 16 or 32 characters at a time with
+// SSSE3/AVX2 when the CPU supports it (chosen once at startup).
+void base64Decode(const char* in, size_t len, std::string& out, Base64State& state);
+
+// Appends the quoted-printable decoding of `in` to `out`. "=\n" and "=\r\n"
+// are soft line breaks; a malformed escape is kept literally.
+void qpDecode(const char* in, size_t len, std::string& out);
+
+// Name of the base64 kernel in use ("avx2", "ssse3" or "scalar")
+const char* base64Backend();
+
+// Switches to the named kernel; false if this CPU cannot run it. Only for
+// benchmarks: not safe while another thread is decoding.
+bool setBase64Backend(const char* name);
+
+} // namespace mail
+
+#endif // MIME_CODEC_H
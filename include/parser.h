@@ -4,7 +4,8 @@
 #include <string>
 #include <vector>
 #include <optional>
-#include <map>
+#include <string_view>
+#include "message_view.h"
 
 namespace mail {
 
@@ -12,6 +13,7 @@ struct BodyPart {
     std::string filename;
     std::string content; // decoded content
     std::string contentType; // added content type field
+    std::string sha256; // binary SHA-256 of content, used for deduplication
 };
 
 struct EmailMessage {
@@ -30,17 +32,20 @@ struct EmailMessage {
 class Parser {
 public:
     static EmailMessage parse(const std::string& rawMessage);
+    // Zero-copy mode: headers and parts as slices of the (owned) raw message,
+    // for callers that only need a few fields or decode parts on demand.
+    static MessageView parseView(std::string rawMessage);
+    // Decoded (unfolded, RFC 2047) header value; empty if absent
+    static std::string headerValue(const HeaderTable &headers, std::string_view name);
+    static std::string decodeContent(std::string_view data, const std::string &encoding);
 
 private:
+    friend class StreamParser; // shares the header and parameter helpers
+    friend class MessageView;
     static void normalizeNewlines(std::string &s);
-    static void splitHeadersBody(const std::string &raw, std::string &headers, std::string &body);
-    static std::map<std::string,std::string> parseHeaders(const std::string &headerBlock);
-    static void parseTopLevelBody(const std::map<std::string,std::string>& headers,
-                                  const std::string &body,
-                                  EmailMessage &out);
-    static std::string decodeContent(const std::string &data, const std::string &encoding);
-    static std::string decodeBase64(const std::string &in);
-    static std::string decodeQuotedPrintable(const std::string &in);
+    static void parseLeaf(const PartView &part, EmailMessage &out);
+    static std::string decodeBase64(std::string_view in);
+    static std::string decodeQuotedPrintable(std::string_view in);
     static std::string trim(const std::string &s);
     static std::string toLower(const std::string &s);
     
@@ -48,8 +53,9 @@ private:
     static std::string decodeHeaderValue(const std::string &value);
     static std::string extractParameter(const std::string &headerValue, const std::string &paramName);
     static std::string extractSenderName(const std::string& fromHeader); 
-    // Debug function to help identify parsing issues
-    static void debugPrint(const std::string& message, const std::string& content = "");
+    // Attachment name: Content-Disposition filename, else Content-Type
+    // name, else "attachment.<subtype>"
+    static std::string attachmentFilename(const std::string& disposition, const std::string& contentType);
 };
 
 } // namespace mail
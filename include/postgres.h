@@ -5,6 +5,7 @@
 #include <vector>
 #include <unordered_map>
 #include <memory>
+#include <chrono>
 #include <pqxx/pqxx>
 
 class PostgresDB {
@@ -15,11 +16,17 @@ public:
     bool connect();
     void disconnect();
     bool isConnected() const;
+    // Round-trips a trivial query; false if the server is unreachable.
+    bool ping();
+    // Drops and reopens the connection, re-registering prepared statements.
+    bool reconnect();
 
     // --- Transaction Methods ---
     void begin();
     void commit();
     void rollback();
+    // Active transaction, for bulk operations such as COPY streams.
+    pqxx::work& transaction();
 
     // --- Query Methods ---
     // Executes a query within a transaction.
@@ -34,6 +41,8 @@ public:
     // Prepares a statement with a specific name.
     void prepare(const std::string& query_name, const std::string& query_text);
     void init_prepared_statements(); // Add this line
+    // Applies idempotent schema additions (once per process).
+    void ensure_schema();
     // Helper to get the ID from a result.
     int getInsertedId(const pqxx::result& result);
 
@@ -44,6 +53,7 @@ private:
     std::string connStr;
     std::unique_ptr<pqxx::connection> conn;
     std::unique_ptr<pqxx::work> tx;
+    std::chrono::steady_clock::time_point txStart; // for the transaction latency metric
 };
 template <typename... Args>
 pqxx::result PostgresDB::execute_prepared(const std::string &query_name, const Args&... args) {
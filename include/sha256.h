@@ -0,0 +1,31 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental SHA-256 (FIPS 180-4). Feed data with update() as it is
+// produced, then call digest() once for the 32-byte binary hash.
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t len);
+    void update(const std::string& s) { update(s.data(), s.size()); }
+    std::string digest();
+
+    // One-shot helper
+    static std::string hash(const std::string& data);
+    // Lower-case hex rendering of a binary digest
+    static std::string hex(const std::string& digest);
+
+private:
+    void transform(const uint8_t* block);
+
+    uint32_t state[8];
+    uint8_t buffer[64];
+    size_t bufferLen = 0;
+    uint64_t totalLen = 0;
+};
+
+#endif // SHA256_H
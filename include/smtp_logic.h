@@ -2,18 +2,32 @@
 #define SMTP_LOGIC_H
 
 #include <string>
+#include <string_view>
 #include "string_manipulation.h"
-#include "postgres.h"
 #include <mutex>
 #include <sstream>
 #include <vector>
 
 struct ConnState; // forward declaration
+struct Worker;
+struct SpfVerdict;
 
 extern std::mutex g_fileMutex;
-extern PostgresDB* g_db;
 
+// Writes a reply straight to a socket that has no session (yet)
 void send_line(int fd, const std::string& s);
-void process_smtp_line(ConnState& st, int fd, const std::string& raw);
+// Queues a reply; the worker flushes a session's replies once per batch
+void send_line(ConnState& st, const std::string& s);
+// Handles one command line, CR/LF already stripped
+void process_smtp_line(Worker& w, ConnState& st, int fd, std::string_view line);
+// DATA fast path: takes whole lines of message text from `data` in bulk,
+// undoing dot-stuffing and stopping after the terminating "." line (which
+// ends DATA). Returns the bytes consumed; an incomplete last line is left.
+size_t consume_data(Worker& w, ConnState& st, int fd, const char* data, size_t len);
+// BDAT: takes up to the rest of the current chunk from `data` as-is (no
+// line handling); replies once the chunk is complete. Returns bytes consumed.
+size_t consume_chunk(Worker& w, ConnState& st, int fd, const char* data, size_t len);
+// Replies to a MAIL FROM once its SPF verdict is in.
+void finish_mail_from(ConnState& st, int fd, const SpfVerdict& verdict);
 
 #endif // SMTP_LOGIC_H
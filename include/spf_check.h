@@ -1,6 +1,7 @@
 #ifndef SPF_CHECKER_H
 #define SPF_CHECKER_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <netinet/in.h>
@@ -8,19 +9,41 @@
 #include <resolv.h>
 
 namespace spf {
+
+// check_host() results (RFC 7208 section 2.6)
+enum class Result {
+    None,       // no SPF record, or no usable domain
+    Neutral,    // "?" or no mechanism matched
+    Pass,
+    Fail,
+    SoftFail,
+    TempError,  // transient DNS failure
+    PermError   // broken record, or a lookup limit was exceeded
+};
+
+const char* result_name(Result r);
+
 /**
- * @brief Checks if an IP address is allowed to send email for a given domain using SPF.
+ * @brief Evaluates the SPF policy of a domain for a client IP (RFC 7208 check_host).
  *
  * This function performs the following:
  *  - Looks up the SPF record (TXT) of the domain.
- *  - Parses mechanisms: ip4, ip6, include, a, mx, all.
- *  - Recursively resolves "include:" and evaluates.
- *  - Returns true if the given IP is authorized, false otherwise.
+ *  - Evaluates mechanisms in order: ip4, ip6, a, mx, include, exists, ptr, all.
+ *  - Follows include: and redirect= recursively.
+ *  - Stops with PermError after 10 DNS-querying terms or 2 void lookups.
  *
  * @param domain The domain name (e.g. "example.com").
  * @param ip The IP address to check (IPv4 or IPv6 as string).
- * @return true if allowed, false otherwise.
+ * @return The SPF result.
  */
-bool spf_allows(const std::string &domain, const std::string &ip);
+Result check_host(const std::string &domain, const std::string &ip);
+
+// Hit/miss counts of the record and answer caches since startup
+struct CacheStats {
+    uint64_t policy_hits = 0, policy_misses = 0;
+    uint64_t address_hits = 0, address_misses = 0;
+    uint64_t mx_hits = 0, mx_misses = 0;
+};
+CacheStats cache_stats();
 }
 #endif // SPF_CHECKER_H
@@ -0,0 +1,31 @@
+#ifndef SPF_ENGINE_H
+#define SPF_ENGINE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "types.h"
+#include "config.h"
+#include "spf_check.h"
+
+// A MAIL FROM waiting for its SPF verdict. Like StorageJob, the connection
+// is identified by (worker, fd, connId) so late verdicts can be dropped.
+struct SpfJob {
+    int worker = 0;
+    int fd = -1;
+    uint64_t connId = 0;
+    std::string sender;
+    std::string domain;
+    std::string ip;
+};
+
+// Starts g_config.spf_threads threads delivering verdicts to `workers`.
+void spf_start(std::vector<Worker>& workers);
+
+// Non-blocking handoff; false if the queue is full.
+bool spf_submit(SpfJob&& job);
+
+// The configured action for an SPF result (g_config.spf_on_*).
+SpfAction spf_action(spf::Result result);
+
+#endif // SPF_ENGINE_H
@@ -0,0 +1,74 @@
+#ifndef SPF_POLICY_H
+#define SPF_POLICY_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace spf {
+
+// An IPv4 or IPv6 address in network byte order
+struct IpAddr {
+    int family = 0;          // AF_INET, AF_INET6, or 0 if unset
+    uint8_t bytes[16] = {};  // IPv4 uses the first four
+
+    // Parses a textual address; false if it is neither IPv4 nor IPv6
+    bool parse(const std::string& text);
+    uint32_t v4() const;     // IPv4 address in host byte order
+};
+
+// Network prefix for ip4:/ip6: terms, kept in binary form
+struct Net4 {
+    uint32_t net;   // host byte order, already masked
+    uint32_t mask;
+    bool contains(uint32_t addr) const { return (addr & mask) == net; }
+};
+
+struct Net6 {
+    uint8_t net[16];   // already masked
+    int prefix;
+    bool contains(const uint8_t* addr) const;
+};
+
+// True if `addr` lies within prefix length cidr4/cidr6 of `base` (same family)
+bool same_network(const IpAddr& addr, const IpAddr& base, int cidr4, int cidr6);
+
+enum class Mechanism : uint8_t {
+    IpTable,   // run of ip4:/ip6: terms sharing a qualifier
+    A,
+    Mx,
+    Include,
+    Exists,
+    Ptr,       // counted against the lookup limit, never matches
+    All
+};
+
+struct Term {
+    Mechanism mech;
+    char qualifier;            // '+', '-', '~' or '?'
+    std::string domain;        // a/mx/include/exists/ptr target; empty = current domain
+    int cidr4 = 32;            // a/mx dual-cidr lengths
+    int cidr6 = 128;
+    std::vector<Net4> v4;      // IpTable only
+    std::vector<Net6> v6;
+};
+
+// An SPF record compiled once into a flat list of terms. Text is parsed
+// here only; evaluation compares binary addresses.
+struct Policy {
+    std::vector<Term> terms;   // in record order
+    std::string redirect;      // redirect= target, if any
+    bool malformed = false;    // syntax error: evaluates to PermError
+};
+
+using PolicyPtr = std::shared_ptr<const Policy>;
+
+// Compiles a "v=spf1 ..." record. Any syntax error (unknown mechanism,
+// bad address or prefix, missing domain, repeated redirect) marks the
+// whole policy malformed, as RFC 7208 requires.
+PolicyPtr compile_policy(const std::string& record);
+
+} // namespace spf
+
+#endif // SPF_POLICY_H
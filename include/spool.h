@@ -0,0 +1,114 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// A message as persisted in the spool.
+struct SpoolRecord {
+    uint64_t id = 0;
+    std::string sender;
+    std::vector<std::string> recipients;
+    std::string raw;
+};
+
+// Write-ahead spool for accepted messages.
+//
+// Messages are appended to numbered segment files in `dir` and made durable
+// with group commit: a flusher thread fdatasync()s once per batch and wakes
+// every writer whose record the sync covered. If a sync fails, the records
+// it covered are reported as lost and appends fail until a new segment has
+// been opened and synced. A "done" record is appended
+// once the message is in Postgres. On startup every message without a done
+// record is recovered and handed to the replay engine. Segments are unlinked
+// oldest-first once nothing in them (or before them) is still pending.
+class Spool {
+public:
+    Spool(const std::string& dir, size_t segmentBytes, int fsyncIntervalMs);
+    ~Spool();
+
+    // Creates the directory, recovers pending messages and starts the flusher.
+    bool open();
+
+    // Appends a message and blocks until it is on stable storage.
+    // Returns the spool id, or 0 if the write failed.
+    uint64_t append(const std::string& sender, const std::vector<std::string>& recipients,
+                    const std::string& raw);
+
+    // Appends without waiting for fsync; pair with waitDurable() so a whole
+    // batch shares one sync. Returns 0 if the write failed.
+    uint64_t enqueue(const std::string& sender, const std::vector<std::string>& recipients,
+                     const std::string& raw);
+
+    // Blocks until the given messages are on stable storage. False if a
+    // sync covering any of them failed; ids of 0 are skipped.
+    bool waitDurable(const std::vector<uint64_t>& ids);
+
+    // The message is stored in the database and must not be replayed.
+    void markDone(uint64_t id);
+
+    // For a message the database will never take: writes it durably to
+    // dir/dead/<id>.eml, envelope first as Return-Path and X-Original-To
+    // headers, then marks it done. False, leaving it pending, if the file
+    // could not be written.
+    bool deadLetter(uint64_t id);
+
+    // Releases an in-flight message back to the replay engine.
+    void release(uint64_t id);
+
+    // Claims up to `max` pending messages that nobody is currently storing.
+    std::vector<uint64_t> claimPending(size_t max);
+
+    // Reads a spooled message back from disk.
+    bool load(uint64_t id, SpoolRecord& out);
+
+    size_t pendingCount();
+
+private:
+    struct Segment;
+    struct Entry {
+        uint64_t segment;
+        uint64_t offset;   // start of the record header
+        uint32_t length;   // payload length
+        bool inFlight;
+        uint64_t seq;      // writtenSeq of the record, 0 if recovered
+        bool lost;         // written, but the fsync meant to cover it failed
+    };
+
+    bool recoverSegment(uint64_t seg);
+    bool openSegment(uint64_t seg);
+    bool rotate();
+    void syncFailed(uint64_t seg);
+    bool writeRecord(uint8_t type, uint64_t id, const std::string& payload, uint64_t& offset);
+    void retireSegments();
+    void flushLoop();
+    std::string segmentPath(uint64_t seg) const;
+
+    std::string dir;
+    size_t segmentBytes;
+    int fsyncIntervalMs;
+
+    std::mutex mtx;
+    std::condition_variable durableCv;   // writers waiting for fsync
+    std::condition_variable flushCv;     // wakes the flusher
+    std::shared_ptr<Segment> active;
+    uint64_t nextId = 1;
+    uint64_t writtenSeq = 0;             // records written to the active fd
+    uint64_t durableSeq = 0;             // records covered by a completed fsync
+    bool failed = false;                 // the active segment failed to sync
+    std::map<uint64_t, Entry> entries;   // pending messages by id
+    std::map<uint64_t, size_t> liveBySegment;
+    bool stopping = false;
+    std::thread flusher;
+};
+
+// Global spool, null when spool_dir is not configured
+extern Spool* g_spool;
+
+#endif // SPOOL_H
@@ -0,0 +1,31 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <optional>
+#include "types.h"
+#include "parser.h"
+
+// A completed DATA transaction handed from an epoll worker to the storage
+// threads. The originating connection is identified by (worker, fd, connId)
+// so a stale acknowledgement for a closed/reused fd can be dropped.
+struct StorageJob {
+    int worker = 0;
+    int fd = -1;
+    uint64_t connId = 0;
+    std::string sender;
+    std::vector<std::string> recipients;
+    std::string raw;
+    std::optional<mail::EmailMessage> parsed; // already parsed during DATA
+    size_t charged = 0;                        // bytes counted in the worker's memory budget
+};
+
+// Starts g_config.storage_threads storage threads delivering acks to `workers`.
+void storage_start(std::vector<Worker>& workers);
+
+// Non-blocking handoff; false if the queue is full.
+bool storage_submit(StorageJob&& job);
+
+#endif // STORAGE_H
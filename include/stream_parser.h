@@ -0,0 +1,71 @@
+#ifndef STREAM_PARSER_H
+#define STREAM_PARSER_H
+
+#include <string>
+#include <vector>
+#include "parser.h"
+#include "sha256.h"
+#include "mime_codec.h"
+
+namespace mail {
+
+// Push-based MIME parser fed while DATA is still arriving.
+//
+// Lines are consumed one at a time by a small state machine (headers ->
+// body, with a stack of multipart boundaries), and leaf bodies are
+// transfer-decoded as they stream past. Nothing holds a second copy of the
+// message: peak memory is the decoded parts themselves. Produces the same
+// EmailMessage as Parser::parse.
+class StreamParser {
+public:
+    StreamParser();
+
+    // Feeds one line of the message without its line terminator.
+    void feedLine(const char* data, size_t len);
+    void feedLine(const std::string& line) { feedLine(line.data(), line.size()); }
+
+    // Feeds arbitrary bytes; lines are split on '\n' (a preceding '\r' is dropped).
+    void feed(const char* data, size_t len);
+
+    // Flushes any open parts and returns the parsed message.
+    EmailMessage finish();
+
+    // Discards a partly fed message; buffers keep their capacity.
+    void reset();
+
+private:
+    enum class Stage { Headers, Body };
+    enum class Sink { None, Plain, Html, Attachment, Multipart };
+
+    struct Entity {
+        Stage stage = Stage::Headers;
+        std::string headerBlock;           // raw header lines, '\n'-joined
+        Sink sink = Sink::None;
+        std::string ctype;                 // lower-cased content type
+        std::string encoding;              // lower-cased transfer encoding
+        std::string filename;              // attachments only
+        std::string boundary;              // multipart only
+        bool ended = false;                // multipart close delimiter seen
+
+        // Leaf decoding state
+        std::string out;
+        bool started = false;              // first non-blank line seen
+        size_t pendingNewlines = 0;        // deferred so trailing blank lines are trimmed
+        Base64State b64;
+        Sha256 hash;                       // attachments: hashed as decoded
+    };
+
+    void onHeaderLine(Entity& e, const char* p, size_t n);
+    void startBody(Entity& e);
+    bool onBoundary(const char* p, size_t n);
+    void appendLeaf(Entity& e, const char* p, size_t n);
+    void closeTop();
+
+    std::vector<Entity> stack;             // [0] is the top-level entity
+    std::string partial;                   // incomplete line from feed()
+    EmailMessage msg;
+};
+
+} // namespace mail
+
+#endif // STREAM_PARSER_H
@@ -2,12 +2,20 @@
 #define STRING_MANIPULATION_H
 
 #include <string>
+#include <string_view>
 
 // Extracts the domain from an email if valid, otherwise returns ""
 std::string getEmailDomain(const std::string& email);
 
 // Extracts the sender email from an SMTP line
-std::string extract_sender(const std::string& line);
+std::string extract_sender(std::string_view line);
+
+// Value of a MAIL FROM parameter (`KEY=value`, key case-insensitive); empty
+// if absent or valueless
+std::string_view extract_mail_param(std::string_view line, std::string_view key);
+
+// Value of the SIZE= parameter of a MAIL FROM line (RFC 1870), -1 if absent
+long long extract_size_param(std::string_view line);
 
 //remove crlf from lines
 void rstrip_crlf(std::string& s);
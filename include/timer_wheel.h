@@ -0,0 +1,78 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Hierarchical timer wheel keyed by small integer ids (a worker uses fds).
+// Four levels of 64 slots; level 0 advances one slot per tick, and a full
+// turn of one level cascades the next level's slot down. Arming, cancelling
+// and pushing a deadline later are O(1): a later deadline only updates the
+// node, which is refiled when its old slot comes due.
+//
+// Not thread-safe; each worker owns one.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimerWheel(std::chrono::milliseconds tick = std::chrono::milliseconds(1000));
+
+    // (Re)arms the timer for `id`
+    void arm(int id, Clock::time_point deadline);
+    void cancel(int id);
+    bool empty() const { return count == 0; }
+
+    // Milliseconds until expire() next has work: the earliest level-0 slot
+    // with timers in it, or the next cascade of a non-empty upper slot.
+    // -1 when nothing is armed. Used as the epoll/io_uring wait timeout.
+    int msUntilNextDeadline(Clock::time_point now) const;
+
+    // Advances to `now` and calls fn(id) for every timer that expired.
+    // fn may arm or cancel timers, including the one that fired.
+    template <typename Fn>
+    void expire(Clock::time_point now, Fn&& fn) {
+        uint64_t target = tickOf(now);
+        if (count == 0) { cur = target; return; }
+        while (cur < target) {
+            ++cur;
+            cascade();
+            int slot = static_cast<int>(cur & kMask);
+            int id;
+            while ((id = heads[0][slot]) >= 0) {
+                unlink(id);
+                if (nodes[id].deadline > cur) file(id); // pushed back since it was filed
+                else fn(id);
+            }
+        }
+    }
+
+private:
+    static constexpr int kLevels = 4;
+    static constexpr int kBits = 6;
+    static constexpr int kSlots = 1 << kBits;
+    static constexpr uint64_t kMask = kSlots - 1;
+
+    struct Node {
+        int prev = -1;
+        int next = -1;
+        int level = -1;            // -1 = not armed
+        int slot = 0;
+        uint64_t deadline = 0;     // tick it expires at
+        uint64_t due = 0;          // tick of the slot it is filed under
+    };
+
+    uint64_t tickOf(Clock::time_point t) const;
+    void file(int id);
+    void unlink(int id);
+    void cascade();
+
+    Clock::time_point origin;
+    std::chrono::milliseconds tick;
+    uint64_t cur = 0;              // last tick processed
+    size_t count = 0;              // armed timers
+    int heads[kLevels][kSlots];
+    std::vector<Node> nodes;
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,95 @@
+#ifndef TTL_CACHE_H
+#define TTL_CACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Thread-safe string-keyed cache whose entries expire after their own TTL
+// (typically the DNS TTL of the answer they hold). Keys are spread over
+// independently locked shards so lookups from many threads rarely contend.
+// Each shard is an LRU like LruCache: get() refreshes recency, and a full
+// shard evicts its least recently used entry, expired or not. Expired
+// entries are otherwise dropped when a lookup finds them.
+template <typename V>
+class TtlCache {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t kShards = 16;
+
+    explicit TtlCache(size_t capacity)
+        : shardCapacity(capacity / kShards + 1), shards(new Shard[kShards]) {}
+
+    bool get(const std::string& key, V& out) {
+        Shard& s = shardFor(key);
+        std::lock_guard<std::mutex> lk(s.mtx);
+        auto it = s.index.find(key);
+        if (it == s.index.end()) {
+            missCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (it->second->expires <= Clock::now()) {
+            s.order.erase(it->second);
+            s.index.erase(it);
+            missCount.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        s.order.splice(s.order.begin(), s.order, it->second);
+        out = it->second->value;
+        hitCount.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    uint64_t hits() const { return hitCount.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return missCount.load(std::memory_order_relaxed); }
+
+    void put(const std::string& key, const V& value, std::chrono::seconds ttl) {
+        if (ttl.count() <= 0) return;
+        Shard& s = shardFor(key);
+        std::lock_guard<std::mutex> lk(s.mtx);
+        auto expires = Clock::now() + ttl;
+        auto it = s.index.find(key);
+        if (it != s.index.end()) {
+            it->second->value = value;
+            it->second->expires = expires;
+            s.order.splice(s.order.begin(), s.order, it->second);
+            return;
+        }
+        if (s.index.size() >= shardCapacity) {
+            s.index.erase(s.order.back().key);
+            s.order.pop_back();
+        }
+        s.order.push_front(Entry{key, value, expires});
+        s.index.emplace(key, s.order.begin());
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        V value;
+        Clock::time_point expires;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::list<Entry> order;    // most recent first
+        std::unordered_map<std::string, typename std::list<Entry>::iterator> index;
+    };
+
+    Shard& shardFor(const std::string& key) {
+        return shards[std::hash<std::string>{}(key) % kShards];
+    }
+
+    size_t shardCapacity;
+    std::unique_ptr<Shard[]> shards;
+    std::atomic<uint64_t> hitCount{0};
+    std::atomic<uint64_t> missCount{0};
+};
+
+#endif // TTL_CACHE_H
@@ -2,24 +2,171 @@
 #define TYPES_H
 
 #include <string>
-#include <sstream>
 #include <vector>
-#include <unordered_map>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <atomic>
+#include "mpmc_queue.h"
+#include "stream_parser.h"
+#include "spf_check.h"
+#include "timer_wheel.h"
 
-// Per-connection state
+// Per-connection state. Slots are recycled (see ConnTable), so buffers
+// keep their capacity from one connection to the next.
 struct ConnState {
+    uint64_t id = 0;                   // unique per accepted connection; 0 = slot free
     bool inData = false;
-    std::string inbuf;                 
-    std::ostringstream dataBuffer;
+    bool awaitingStorage = false;      // DATA handed off, reply pending
+    bool awaitingSpf = false;          // MAIL FROM handed to an SPF thread
+    bool helo = false;                 // HELO or EHLO seen
+    std::string inbuf;
+    std::string dataBuffer;            // message text, CRLF kept: DATA dot-unstuffed, BDAT chunks raw
+    std::unique_ptr<mail::StreamParser> parser; // fed each run as it is appended to dataBuffer
     std::string sender;
     std::vector<std::string> recipients;
     std::string ip;
+    std::string outbuf;                // replies not yet written to the socket
+    bool wantWrite = false;            // waiting for the socket: EPOLLOUT registered, or an io_uring send in flight
+    bool closing = false;              // QUIT seen; close once outbuf is flushed
+    bool oversize = false;             // DATA past max_message_size; rest is discarded
+    bool longLine = false;             // DATA line past kMaxLineLength; rest is discarded
+    bool skipLine = false;             // dropping the rest of an over-long line
+    bool throttled = false;            // reads paused by the memory budget
+    bool inputFull = false;            // reads paused: kMaxPausedInput held while paused()
+    bool bdat = false;                 // BDAT transaction: chunks received, LAST not yet
+    bool binaryMime = false;           // MAIL FROM BODY=BINARYMIME (BDAT only)
+    uint64_t chunkRemaining = 0;       // bytes of the current BDAT chunk still to read
+    uint64_t chunkSize = 0;            // size of the current BDAT chunk
+    bool chunkLast = false;            // current chunk is BDAT ... LAST
+    const char* chunkReply = nullptr;  // error for a chunk read only to be discarded
+    size_t bufferedBytes = 0;          // inbuf + DATA bytes counted in WorkerLoad::buffered
+
+    // Commands are held back while a reply depends on another thread, or
+    // while a client that does not read its replies has too many queued
+    static constexpr size_t kMaxPendingOutput = 64 * 1024;
+    static constexpr size_t kMaxLineLength = 64 * 1024; // longer lines are rejected
+    static constexpr size_t kMaxPausedInput = 2 * kMaxLineLength; // unread input while paused()
+    bool paused() const {
+        return awaitingStorage || awaitingSpf || closing || outbuf.size() >= kMaxPendingOutput;
+    }
+
+    // Message text is arriving (DATA, or a BDAT transaction)
+    bool transferring() const { return inData || bdat || chunkRemaining > 0; }
+
+    // Returns the slot to its initial state. Buffers are cleared, not freed,
+    // unless one session grew them past kKeepCapacity.
+    static constexpr size_t kKeepCapacity = 64 * 1024;
+    void reset() {
+        id = 0;
+        inData = awaitingStorage = awaitingSpf = helo = false;
+        wantWrite = closing = false;
+        oversize = longLine = skipLine = throttled = inputFull = false;
+        bdat = binaryMime = chunkLast = false;
+        chunkRemaining = chunkSize = 0;
+        chunkReply = nullptr;
+        bufferedBytes = 0;
+        if (parser) parser->reset(); // kept, like the buffers
+        sender.clear();
+        recipients.clear();
+        ip.clear();
+        for (std::string* buf : {&inbuf, &dataBuffer, &outbuf}) {
+            if (buf->capacity() > kKeepCapacity) std::string().swap(*buf);
+            else buf->clear();
+        }
+    }
+};
+
+// Connection states of one worker, indexed directly by fd. The kernel
+// hands out the lowest free fd, so slots (and their buffers) are reused
+// as connections come and go and the table stays dense.
+class ConnTable {
+public:
+    ConnState* find(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd) >= slots.size() || slots[fd].id == 0) return nullptr;
+        return &slots[fd];
+    }
+
+    // Claims the slot for fd; `id` must be non-zero
+    ConnState& open(int fd, uint64_t id) {
+        if (static_cast<size_t>(fd) >= slots.size()) slots.resize(static_cast<size_t>(fd) + 1);
+        ConnState& st = slots[fd];
+        st.id = id;
+        ++live;
+        return st;
+    }
+
+    void release(int fd) {
+        ConnState* st = find(fd);
+        if (!st) return;
+        st->reset();
+        --live;
+    }
+
+    size_t size() const { return live; }
+
+private:
+    std::vector<ConnState> slots;
+    size_t live = 0;
+};
+
+// Storage outcome routed back to the owning worker, which sends the reply.
+struct StorageAck {
+    int fd = -1;
+    uint64_t connId = 0;
+    std::string reply;
 };
 
+// SPF verdict for a MAIL FROM, routed back to the owning worker.
+struct SpfVerdict {
+    int fd = -1;
+    uint64_t connId = 0;
+    std::string sender;
+    spf::Result result = spf::Result::None;
+};
+
+// Accepted connection passed to the worker that will own it.
+struct Handoff {
+    int fd = -1;
+    std::string ip;
+};
+
+// Load published by a worker for the connection dispatcher. Updated by the
+// owning worker (queued also by hand_off callers); read by any thread.
+struct WorkerLoad {
+    std::atomic<int> conns{0};          // open sessions
+    std::atomic<int> queued{0};         // handed off, not yet adopted
+    std::atomic<int> pending{0};        // storage jobs and SPF checks in flight
+    std::atomic<int64_t> buffered{0};   // bytes held in session buffers
+
+    // Single figure compared by the dispatcher; a session waiting on
+    // storage or SPF, or holding a large DATA transfer, weighs more than an
+    // idle one
+    int64_t score() const {
+        return conns.load(std::memory_order_relaxed) + queued.load(std::memory_order_relaxed)
+             + 4 * static_cast<int64_t>(pending.load(std::memory_order_relaxed))
+             + buffered.load(std::memory_order_relaxed) / 65536;
+    }
+};
+
+class UringLoop;
+
 // Worker struct holding epoll fd and connection states
 struct Worker {
+    int id = 0;
     int epfd = -1;
-    std::unordered_map<int, ConnState> conns;
+    int listenFd = -1;                              // this worker's SO_REUSEPORT listener
+    int evfd = -1;                                  // eventfd signalled when acks, verdicts or handoffs arrive
+    std::unique_ptr<BoundedQueue<Handoff>> incoming; // connections from the acceptor thread
+    std::unique_ptr<BoundedQueue<StorageAck>> acks; // filled by storage threads
+    std::unique_ptr<BoundedQueue<SpfVerdict>> spfVerdicts; // filled by SPF threads
+    ConnTable conns;
+    std::vector<char> recvBuf;                      // scratch for recv(), buf_sz bytes
+    std::vector<std::pair<int, uint64_t>> throttled; // (fd, connId) not read while over the memory budget
+    TimerWheel timers;                              // session timeouts, keyed by fd
+    TimerWheel::Clock::time_point now;              // refreshed after each epoll_wait
+    UringLoop* ring = nullptr;                      // io_uring backend in use; null = epoll
+    WorkerLoad load;
 };
 
 #endif // TYPES_H
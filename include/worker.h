@@ -9,9 +9,44 @@
 
 
 
+// Accepts every pending connection on the worker's listener and registers
+// it with the worker's epoll set.
+void accept_connections(Worker& w);
+// Passes an accepted connection to `w` from another thread. False (and the
+// caller still owns fd) if the worker's handoff queue is full.
+bool hand_off(Worker& w, int fd, const std::string& ip);
+// Registers connections handed to this worker since the last wakeup.
+void adopt_connections(Worker& w);
+// Places a connection accepted by `w`: hands it to a less loaded worker if
+// the dispatch policy picks one, otherwise registers it with `w`.
+void take_connection(Worker& w, int cfd, const std::string& ip);
+// Creates the session for a connection owned by `w` and sends the banner.
+void register_connection(Worker& w, int cfd, const std::string& ip);
+void close_connection(Worker& w, int fd);
 void handle_readable(Worker& w, int fd);
+// Bytes received for a session by the io_uring backend (len 0: peer closed).
+void handle_received(Worker& w, int fd, const char* data, size_t len);
+// Resumes a session whose replies were waiting for socket buffer space.
+void handle_writable(Worker& w, int fd);
+// Sends replies for completed storage jobs and resumes paused connections.
+void handle_storage_acks(Worker& w);
+// Finishes MAIL FROM commands whose SPF check has completed.
+void handle_spf_verdicts(Worker& w);
+// epoll_wait timeout covering the timer wheel and throttled sessions.
+int next_wakeup_ms(const Worker& w);
+// Once per batch of events: resumes throttled sessions, expires timeouts.
+void end_of_batch(Worker& w);
 void worker_loop(Worker* wptr, int id);
 
+// True while buffered session data across all workers, messages queued for
+// storage included, exceeds memory_budget_mb. New mail is refused with 452
+// and sessions that are not mid-DATA stop being read until usage drops.
+bool memory_over_budget();
+// Counts bytes held for `w` outside its session buffers against the budget
+// (negative to release them): a message queued for storage is charged
+// until the storage thread is done with it.
+void charge_buffered(Worker& w, int64_t delta);
+
 // Make fd non-blocking
  int make_nonblocking(int fd);
 
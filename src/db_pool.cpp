@@ -0,0 +1,111 @@
+#include "db_pool.h"
+#include "logger.h"
+#include <iostream>
+#include <stdexcept>
+
+DbPool* g_db_pool = nullptr;
+
+// --- Lease ---
+DbPool::Lease::Lease(Lease&& other) noexcept
+    : pool(other.pool), slot(other.slot) {
+    other.pool = nullptr;
+}
+
+DbPool::Lease& DbPool::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        slot = other.slot;
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+DbPool::Lease::~Lease() {
+    release();
+}
+
+PostgresDB& DbPool::Lease::db() const {
+    return *pool->slots[slot]->db;
+}
+
+void DbPool::Lease::markBroken() {
+    if (pool) pool->slots[slot]->broken = true;
+}
+
+void DbPool::Lease::release() {
+    if (!pool) return;
+    DbPool::Slot& s = *pool->slots[slot];
+    s.db->rollback(); // no-op unless the holder left a transaction open
+    if (!s.db->isConnected()) s.broken = true;
+    s.lastUsed = std::chrono::steady_clock::now();
+    s.mtx.unlock();
+    pool = nullptr;
+}
+
+// --- Pool ---
+DbPool::DbPool(const std::string& connectionStr, int size, int healthCheckSecs)
+    : connStr(connectionStr), healthInterval(healthCheckSecs) {
+    if (size < 1) size = 1;
+    slots.reserve(size);
+    for (int i = 0; i < size; ++i) {
+        auto s = std::make_unique<Slot>();
+        s->db = std::make_unique<PostgresDB>(connStr);
+        slots.push_back(std::move(s));
+    }
+}
+
+bool DbPool::init() {
+    size_t ok = 0;
+    for (auto& s : slots) {
+        if (!s->db->connect()) { s->broken = true; continue; }
+        try {
+            s->db->init_prepared_statements();
+            s->lastUsed = std::chrono::steady_clock::now();
+            ++ok;
+        } catch (const std::exception& e) {
+            LOG_ERROR("Failed to initialize prepared statements: " << e.what());
+            s->broken = true;
+        }
+    }
+    LOG_INFO("DB pool: " << ok << "/" << slots.size() << " connections ready.");
+    return ok > 0;
+}
+
+// Caller holds s.mtx
+bool DbPool::ensureHealthy(Slot& s) {
+    if (!s.broken && s.db->isConnected()) {
+        // Only ping connections that sat idle long enough to have been
+        // dropped by the server or a middlebox; hot connections skip it.
+        if (healthInterval.count() <= 0 ||
+            std::chrono::steady_clock::now() - s.lastUsed < healthInterval) {
+            return true;
+        }
+        if (s.db->ping()) return true;
+    }
+    LOG_WARN("DB pool: reconnecting broken connection");
+    s.broken = !s.db->reconnect();
+    return !s.broken;
+}
+
+DbPool::Lease DbPool::acquire(int affinity) {
+    size_t n = slots.size();
+    size_t home = affinity < 0 ? 0 : static_cast<size_t>(affinity) % n;
+
+    // Home slot first, then any idle one, then wait for home
+    size_t chosen = n;
+    for (size_t i = 0; i < n; ++i) {
+        size_t idx = (home + i) % n;
+        if (slots[idx]->mtx.try_lock()) { chosen = idx; break; }
+    }
+    if (chosen == n) {
+        slots[home]->mtx.lock();
+        chosen = home;
+    }
+
+    Lease lease(this, chosen);
+    if (!ensureHealthy(*slots[chosen])) {
+        throw std::runtime_error("Database connection unavailable.");
+    }
+    return lease;
+}
@@ -0,0 +1,50 @@
+#include "dispatch.h"
+#include "config.h"
+#include <atomic>
+#include <random>
+
+static std::vector<Worker>* g_workers = nullptr;
+static std::atomic<unsigned> g_next_worker{0};
+
+void dispatch_init(std::vector<Worker>& workers) {
+    g_workers = &workers;
+}
+
+static size_t random_index(size_t n) {
+    thread_local std::minstd_rand rng(std::random_device{}());
+    return rng() % n;
+}
+
+static Worker& least_loaded(Worker* local) {
+    Worker* best = local;
+    int64_t best_score = local ? local->load.score() : 0;
+    for (Worker& w : *g_workers) {
+        int64_t score = w.load.score();
+        if (!best || score < best_score) { best = &w; best_score = score; }
+    }
+    return *best;
+}
+
+// Two distinct random workers; an accepting worker is always one of them
+static Worker& power_of_two(Worker* local) {
+    std::vector<Worker>& ws = *g_workers;
+    size_t n = ws.size();
+    Worker* a = local ? local : &ws[random_index(n)];
+    if (n < 2) return *a;
+    Worker* b = &ws[random_index(n - 1)];
+    if (b == a) b = &ws[n - 1];
+    return b->load.score() < a->load.score() ? *b : *a;
+}
+
+Worker& pick_worker(Worker* local) {
+    switch (g_config.dispatch_policy) {
+        case DispatchPolicy::LeastLoaded:
+            return least_loaded(local);
+        case DispatchPolicy::PowerOfTwo:
+            return power_of_two(local);
+        case DispatchPolicy::RoundRobin:
+            break;
+    }
+    if (local) return *local;
+    return (*g_workers)[g_next_worker.fetch_add(1, std::memory_order_relaxed) % g_workers->size()];
+}
@@ -0,0 +1,233 @@
+#include "dns_resolver.h"
+#include "logger.h"
+#include <resolv.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+namespace spf {
+
+// --- system resolver --------------------------------------------------------
+// Helper: Run a DNS query and let `fn` convert each answer record of `type`
+template <typename T, typename Fn>
+static DnsAnswer<T> dns_query(const std::string& domain, int type, Fn fn) {
+    DnsAnswer<T> ans;
+    unsigned char answer[4096];
+
+    int len = res_query(domain.c_str(), C_IN, type, answer, sizeof(answer));
+    if (len < 0) {
+        // NXDOMAIN and NODATA are answers; anything else is worth a retry
+        ans.temp_error = h_errno != HOST_NOT_FOUND && h_errno != NO_DATA;
+        return ans;
+    }
+
+    ns_msg handle;
+    if (ns_initparse(answer, len, &handle) < 0) return ans;
+
+    bool first = true;
+    int count = ns_msg_count(handle, ns_s_an);
+    for (int i = 0; i < count; i++) {
+        ns_rr rr;
+        if (ns_parserr(&handle, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == type) {
+            T value;
+            if (!fn(handle, rr, value)) continue;
+            ans.values.push_back(std::move(value));
+            uint32_t ttl = ns_rr_ttl(rr);
+            if (first || ttl < ans.ttl) ans.ttl = ttl;
+            first = false;
+        }
+    }
+    return ans;
+}
+
+DnsAnswer<std::string> SystemResolver::txt(const std::string& name) {
+    return dns_query<std::string>(name, ns_t_txt, [](ns_msg&, ns_rr& rr, std::string& txt) {
+        const unsigned char* rdata = ns_rr_rdata(rr);
+        int rdlen = ns_rr_rdlen(rr);
+
+        // TXT records can have multiple character strings
+        int pos = 0;
+        while (pos < rdlen) {
+            int segment_len = rdata[pos++];
+            if (pos + segment_len > rdlen) break;
+            txt.append(reinterpret_cast<const char*>(rdata + pos), segment_len);
+            pos += segment_len;
+        }
+        return true;
+    });
+}
+
+// A and AAAA, queried directly (not getaddrinfo) so the answers carry TTLs
+DnsAnswer<IpAddr> SystemResolver::addresses(const std::string& name) {
+    auto to_ip = [](int family) {
+        return [family](ns_msg&, ns_rr& rr, IpAddr& ip) {
+            size_t expect = family == AF_INET ? 4 : 16;
+            if (ns_rr_rdlen(rr) != expect) return false;
+            ip.family = family;
+            std::memcpy(ip.bytes, ns_rr_rdata(rr), expect);
+            return true;
+        };
+    };
+    DnsAnswer<IpAddr> ans = dns_query<IpAddr>(name, ns_t_a, to_ip(AF_INET));
+    DnsAnswer<IpAddr> v6 = dns_query<IpAddr>(name, ns_t_aaaa, to_ip(AF_INET6));
+    ans.temp_error = ans.temp_error || v6.temp_error;
+    if (!v6.values.empty()) {
+        if (ans.values.empty() || v6.ttl < ans.ttl) ans.ttl = v6.ttl;
+        ans.values.insert(ans.values.end(), v6.values.begin(), v6.values.end());
+    }
+    return ans;
+}
+
+DnsAnswer<std::string> SystemResolver::mx(const std::string& name) {
+    return dns_query<std::string>(name, ns_t_mx, [](ns_msg& handle, ns_rr& rr, std::string& host) {
+        char mxname[NS_MAXDNAME];
+        const unsigned char* rdata = ns_rr_rdata(rr);
+        // Skip preference value (2 bytes)
+        if (dn_expand(ns_msg_base(handle), ns_msg_end(handle), rdata + 2, mxname, sizeof(mxname)) < 0) return false;
+        host = mxname;
+        return true;
+    });
+}
+
+// --- zone-file resolver -----------------------------------------------------
+static std::string zone_key(std::string name) {
+    if (!name.empty() && name.back() == '.') name.pop_back();
+    for (char& c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return name;
+}
+
+template <typename T>
+static void add_record(DnsAnswer<T>& ans, T value, uint32_t ttl) {
+    if (ans.values.empty() || ttl < ans.ttl) ans.ttl = ttl;
+    ans.values.push_back(std::move(value));
+}
+
+// Concatenates the quoted character strings of a TXT record's data
+static bool parse_txt_data(const std::string& data, std::string& out) {
+    size_t pos = 0;
+    bool any = false;
+    while ((pos = data.find('"', pos)) != std::string::npos) {
+        size_t end = pos + 1;
+        std::string part;
+        while (end < data.size() && data[end] != '"') {
+            if (data[end] == '\\' && end + 1 < data.size()) ++end;
+            part.push_back(data[end++]);
+        }
+        if (end >= data.size()) return false; // unterminated
+        out += part;
+        any = true;
+        pos = end + 1;
+    }
+    return any;
+}
+
+bool ZoneResolver::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) return false;
+
+    std::string line;
+    int lineno = 0;
+    while (std::getline(file, line)) {
+        ++lineno;
+        // Comments start with ';' or '#' outside TXT quotes
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (line[i] == '"') quoted = !quoted;
+            else if (!quoted && (line[i] == ';' || line[i] == '#')) { line.erase(i); break; }
+        }
+
+        std::istringstream iss(line);
+        std::string name, tok;
+        if (!(iss >> name)) continue; // blank
+        uint32_t ttl = 3600;
+        if (!(iss >> tok)) { LOG_ERROR(path << ":" << lineno << ": missing record type"); return false; }
+        if (std::isdigit(static_cast<unsigned char>(tok[0]))) {
+            // RFC 2181 section 8: a TTL is an unsigned 31-bit value
+            const char* end = tok.data() + tok.size();
+            auto parsed = std::from_chars(tok.data(), end, ttl);
+            if (parsed.ec != std::errc() || parsed.ptr != end || ttl > 0x7FFFFFFFu) {
+                LOG_ERROR(path << ":" << lineno << ": bad TTL " << tok);
+                return false;
+            }
+            if (!(iss >> tok)) { LOG_ERROR(path << ":" << lineno << ": missing record type"); return false; }
+        }
+        if (zone_key(tok) == "in" && !(iss >> tok)) { LOG_ERROR(path << ":" << lineno << ": missing record type"); return false; }
+        std::string type = zone_key(tok);
+        std::string data;
+        std::getline(iss, data);
+
+        Node& node = zone[zone_key(name)];
+        std::istringstream ds(data);
+        bool ok = true;
+        if (type == "a" || type == "aaaa") {
+            std::string text;
+            IpAddr ip;
+            ok = (ds >> text) && ip.parse(text) && (ip.family == AF_INET) == (type == "a");
+            if (ok) add_record(node.addrs, ip, ttl);
+        } else if (type == "mx") {
+            int pref;
+            std::string host;
+            ok = static_cast<bool>(ds >> pref >> host);
+            if (ok) add_record(node.mx, zone_key(host), ttl);
+        } else if (type == "txt") {
+            std::string txt;
+            ok = parse_txt_data(data, txt);
+            if (ok) add_record(node.txt, std::move(txt), ttl);
+        } else if (type == "servfail") {
+            node.servfail = true;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            LOG_ERROR(path << ":" << lineno << ": bad " << tok << " record");
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+DnsAnswer<T> ZoneResolver::lookup(const std::string& name, DnsAnswer<T> Node::*field, int queries) {
+    if (latency_us > 0) std::this_thread::sleep_for(std::chrono::microseconds(latency_us * queries));
+    auto it = zone.find(zone_key(name));
+    if (it == zone.end()) return DnsAnswer<T>();      // NXDOMAIN
+    if (it->second.servfail) {
+        DnsAnswer<T> ans;
+        ans.temp_error = true;
+        return ans;
+    }
+    return it->second.*field;
+}
+
+DnsAnswer<std::string> ZoneResolver::txt(const std::string& name) {
+    return lookup(name, &Node::txt, 1);
+}
+
+DnsAnswer<IpAddr> ZoneResolver::addresses(const std::string& name) {
+    return lookup(name, &Node::addrs, 2); // A and AAAA
+}
+
+DnsAnswer<std::string> ZoneResolver::mx(const std::string& name) {
+    return lookup(name, &Node::mx, 1);
+}
+
+// --- active resolver --------------------------------------------------------
+static std::unique_ptr<Resolver> g_resolver;
+
+Resolver& resolver() {
+    static SystemResolver system;
+    return g_resolver ? *g_resolver : system;
+}
+
+void set_resolver(std::unique_ptr<Resolver> r) {
+    g_resolver = std::move(r);
+}
+
+} // namespace spf
@@ -0,0 +1,457 @@
+#include "io_uring_loop.h"
+#include "worker.h"
+#include "config.h"
+#include "logger.h"
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// What a request was for; kept with the fd in the upper half of user_data
+enum class Op : uint32_t { Accept = 1, Wake, Recv, Send, Cancel };
+
+static uint64_t tag(Op op, int fd) {
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+// A worker's ring, its provided receive buffers and the requests in flight
+// per session fd
+class UringLoop {
+public:
+    // Requests a session has in flight. Its fd stays open until none are
+    // left, so the kernel cannot hand the number to a new connection while
+    // completions for the old one are still due.
+    struct Pending {
+        bool recv = false;         // multishot recv armed
+        bool send = false;         // send in flight
+        bool closing = false;      // session closed; fd closed when idle
+        bool deferred = false;     // waiting in `deferred` for a free SQE
+        std::vector<char> out;     // bytes of the send in flight
+        size_t outOff = 0;         // of which already written
+    };
+
+    ~UringLoop();
+    bool init(unsigned entries, unsigned buffers, unsigned bufferSize);
+
+    // A free SQE, or nullptr when the ring stays full: the kernel refuses
+    // submissions until completions are reaped (EBUSY), or enter failed
+    io_uring_sqe* sqe();
+    // Submits queued requests and waits up to timeout_ms (-1 = no limit)
+    // for at least one completion. False on a hard error.
+    bool wait(int timeout_ms);
+    template <typename Fn>
+    void drain(Fn&& fn) {
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & cqMask];
+            __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+            fn(cqe);
+        }
+    }
+
+    const char* buffer(uint16_t bid) const { return bufferMem.data() + static_cast<size_t>(bid) * bufferSize; }
+    void recycle(uint16_t bid);
+
+    Pending& at(int fd) {
+        if (static_cast<size_t>(fd) >= fds.size()) fds.resize(static_cast<size_t>(fd) + 1);
+        return fds[fd];
+    }
+
+    void arm_recv(int fd);
+    void submit_send(int fd);
+    void cancel_all(int fd);
+    void close_if_idle(int fd);
+
+    // fds whose request found no free SQE; retry_deferred submits what
+    // each still needs once completions have been reaped
+    void defer(int fd);
+    std::vector<int> take_deferred() { return std::exchange(deferred, {}); }
+    bool has_deferred() const { return !deferred.empty(); }
+
+    static constexpr uint16_t kBufferGroup = 0;
+
+private:
+    int ringFd = -1;
+    void* ringMem = nullptr;
+    size_t ringSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned sqLocalTail = 0;      // SQEs handed out, published on submit
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    io_uring_buf_ring* bufRing = nullptr;
+    size_t bufRingSize = 0;
+    unsigned bufEntries = 0;
+    unsigned bufferSize = 0;
+    uint16_t bufTail = 0;
+    std::vector<char> bufferMem;
+
+    std::vector<Pending> fds;
+    std::vector<int> deferred;
+
+    int enter(unsigned submit, unsigned wait_nr, unsigned flags, void* arg, size_t argsz);
+};
+
+int UringLoop::enter(unsigned submit, unsigned wait_nr, unsigned flags, void* arg, size_t argsz) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, submit, wait_nr, flags, arg, argsz));
+}
+
+UringLoop::~UringLoop() {
+    if (bufRing) munmap(bufRing, bufRingSize);
+    if (sqes) munmap(sqes, sqesSize);
+    if (ringMem) munmap(ringMem, ringSize);
+    if (ringFd >= 0) close(ringFd);
+}
+
+bool UringLoop::init(unsigned entries, unsigned buffers, unsigned size) {
+    io_uring_params p{};
+    // One thread submits, and completions are reaped only when it waits
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 8; // multishot requests post many completions each
+    ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+    if (ringFd < 0 && errno == EINVAL) {
+        p = io_uring_params{};
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 8;
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+    }
+    if (ringFd < 0) return false;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) return false;
+
+    ringSize = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                        p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+    ringMem = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (ringMem == MAP_FAILED) { ringMem = nullptr; return false; }
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* sq = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED) return false;
+    sqes = static_cast<io_uring_sqe*>(sq);
+
+    char* base = static_cast<char*>(ringMem);
+    sqHead = reinterpret_cast<unsigned*>(base + p.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    sqLocalTail = *sqTail;
+    unsigned* array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+    for (unsigned i = 0; i < sqEntries; ++i) array[i] = i; // SQE i always sits in slot i
+    cqHead = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + p.cq_off.cqes);
+
+    // Provided buffer ring: recv picks a free buffer when data arrives, so
+    // idle sessions hold no receive memory
+    bufEntries = 1;
+    while (bufEntries < buffers && bufEntries < 32768) bufEntries <<= 1;
+    bufferSize = size;
+    bufRingSize = bufEntries * sizeof(io_uring_buf);
+    void* br = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) return false;
+    bufRing = static_cast<io_uring_buf_ring*>(br);
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufRing);
+    reg.ring_entries = bufEntries;
+    reg.bgid = kBufferGroup;
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+    bufferMem.resize(static_cast<size_t>(bufEntries) * bufferSize);
+    for (unsigned i = 0; i < bufEntries; ++i) recycle(static_cast<uint16_t>(i));
+    return true;
+}
+
+void UringLoop::recycle(uint16_t bid) {
+    // Entries are indexed from the ring's start; bufs[] cannot be used from
+    // C++, where the header's empty struct moves it one entry along
+    io_uring_buf& b = reinterpret_cast<io_uring_buf*>(bufRing)[bufTail & (bufEntries - 1)];
+    b.addr = reinterpret_cast<uint64_t>(buffer(bid));
+    b.len = bufferSize;
+    b.bid = bid;
+    __atomic_store_n(&bufRing->tail, ++bufTail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* UringLoop::sqe() {
+    // Full: push what is queued to the kernel first. EBUSY means the
+    // completion queue must be drained before it takes more, which only the
+    // loop can do, so retrying here would spin.
+    for (int tries = 0; sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries; ++tries) {
+        if (tries == 3) return nullptr;
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        if (enter(sqLocalTail - *sqHead, 0, 0, nullptr, 0) < 0 && errno != EINTR) {
+            if (errno != EBUSY) LOG_ERRNO("io_uring_enter");
+            return nullptr;
+        }
+    }
+    io_uring_sqe* s = &sqes[sqLocalTail & sqMask];
+    std::memset(s, 0, sizeof(*s));
+    ++sqLocalTail;
+    return s;
+}
+
+bool UringLoop::wait(int timeout_ms) {
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    unsigned submit = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    __kernel_timespec ts{};
+    io_uring_getevents_arg arg{};
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int r = (flags & IORING_ENTER_EXT_ARG) ? enter(submit, 1, flags, &arg, sizeof(arg))
+                                           : enter(submit, 1, flags, nullptr, 0);
+    if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) return false;
+    return true;
+}
+
+void UringLoop::arm_recv(int fd) {
+    io_uring_sqe* s = sqe();
+    if (!s) { defer(fd); return; }
+    s->opcode = IORING_OP_RECV;
+    s->fd = fd;
+    s->ioprio = IORING_RECV_MULTISHOT;
+    s->flags = IOSQE_BUFFER_SELECT;
+    s->buf_group = kBufferGroup;
+    s->user_data = tag(Op::Recv, fd);
+    at(fd).recv = true;
+}
+
+void UringLoop::submit_send(int fd) {
+    io_uring_sqe* s = sqe();
+    if (!s) { defer(fd); return; }
+    Pending& p = at(fd);
+    s->opcode = IORING_OP_SEND;
+    s->fd = fd;
+    s->addr = reinterpret_cast<uint64_t>(p.out.data() + p.outOff);
+    s->len = static_cast<uint32_t>(p.out.size() - p.outOff);
+    s->msg_flags = MSG_NOSIGNAL;
+    s->user_data = tag(Op::Send, fd);
+    p.send = true;
+}
+
+void UringLoop::cancel_all(int fd) {
+    io_uring_sqe* s = sqe();
+    if (!s) { defer(fd); return; }
+    s->opcode = IORING_OP_ASYNC_CANCEL;
+    s->fd = fd;
+    s->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    s->user_data = tag(Op::Cancel, fd);
+}
+
+void UringLoop::defer(int fd) {
+    Pending& p = at(fd);
+    if (p.deferred) return;
+    p.deferred = true;
+    deferred.push_back(fd);
+}
+
+void UringLoop::close_if_idle(int fd) {
+    Pending& p = at(fd);
+    if (!p.closing || p.recv || p.send) return;
+    close(fd);
+    p.closing = false;
+    p.outOff = 0;
+    if (p.out.capacity() > ConnState::kKeepCapacity) std::vector<char>().swap(p.out);
+    else p.out.clear();
+}
+
+// --- hooks for the session code ---------------------------------------------
+void uring_watch(Worker& w, int fd) {
+    if (!w.ring->at(fd).recv) w.ring->arm_recv(fd);
+}
+
+void uring_pause_reads(Worker& w, int fd) {
+    if (!w.ring->at(fd).recv) return;
+    io_uring_sqe* s = w.ring->sqe();
+    if (!s) { w.ring->defer(fd); return; }
+    s->opcode = IORING_OP_ASYNC_CANCEL;
+    s->fd = -1;
+    s->addr = tag(Op::Recv, fd);
+    s->user_data = tag(Op::Cancel, fd);
+}
+
+void uring_send(Worker& w, int fd, std::string& out) {
+    UringLoop::Pending& p = w.ring->at(fd);
+    p.out.assign(out.begin(), out.end());
+    p.outOff = 0;
+    out.clear();
+    w.ring->submit_send(fd);
+}
+
+void uring_close(Worker& w, int fd) {
+    UringLoop::Pending& p = w.ring->at(fd);
+    p.closing = true;
+    if (p.recv || p.send) w.ring->cancel_all(fd);
+    w.ring->close_if_idle(fd);
+}
+
+// --- completions ------------------------------------------------------------
+static void arm_accept(UringLoop& ring, int listenFd) {
+    io_uring_sqe* s = ring.sqe();
+    if (!s) { ring.defer(listenFd); return; }
+    s->opcode = IORING_OP_ACCEPT;
+    s->fd = listenFd;
+    s->ioprio = IORING_ACCEPT_MULTISHOT;
+    s->accept_flags = SOCK_NONBLOCK;
+    s->user_data = tag(Op::Accept, listenFd);
+}
+
+static void arm_wake(UringLoop& ring, int evfd) {
+    io_uring_sqe* s = ring.sqe();
+    if (!s) { ring.defer(evfd); return; }
+    s->opcode = IORING_OP_POLL_ADD;
+    s->fd = evfd;
+    s->poll32_events = POLLIN;
+    s->len = IORING_POLL_ADD_MULTI;
+    s->user_data = tag(Op::Wake, evfd);
+}
+
+static void on_recv(Worker& w, UringLoop& ring, int fd, const io_uring_cqe& cqe) {
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more) ring.at(fd).recv = false;
+    bool closing = ring.at(fd).closing;
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        // handle_received copies the bytes, so the buffer goes straight back
+        if (!closing && cqe.res > 0) handle_received(w, fd, ring.buffer(bid), static_cast<size_t>(cqe.res));
+        ring.recycle(bid);
+    } else if (!closing && cqe.res == 0) {
+        handle_received(w, fd, nullptr, 0); // peer closed
+        return;
+    } else if (!closing && cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        close_connection(w, fd);
+        return;
+    }
+    if (ring.at(fd).closing) { ring.close_if_idle(fd); return; }
+    // The multishot recv ended (buffers ran out, or it was cancelled for a
+    // pause that has since lifted): start another
+    ConnState* st = w.conns.find(fd);
+    if (!more && st && !st->throttled && !st->inputFull && !ring.at(fd).recv) ring.arm_recv(fd);
+}
+
+static void on_send(Worker& w, UringLoop& ring, int fd, const io_uring_cqe& cqe) {
+    UringLoop::Pending& p = ring.at(fd);
+    p.send = false;
+    if (p.closing) { ring.close_if_idle(fd); return; }
+    if (cqe.res < 0) { close_connection(w, fd); return; }
+    p.outOff += static_cast<size_t>(cqe.res);
+    if (p.outOff < p.out.size()) { ring.submit_send(fd); return; } // short write
+    p.out.clear();
+    p.outOff = 0;
+    ConnState* st = w.conns.find(fd);
+    if (!st) return;
+    st->wantWrite = false;
+    handle_writable(w, fd);
+}
+
+static void on_completion(Worker& w, UringLoop& ring, const io_uring_cqe& cqe) {
+    Op op = static_cast<Op>(cqe.user_data >> 32);
+    int fd = static_cast<int>(static_cast<uint32_t>(cqe.user_data));
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    switch (op) {
+    case Op::Accept:
+        if (cqe.res >= 0) {
+            sockaddr_in cli{};
+            socklen_t len = sizeof(cli);
+            char ip_str[INET_ADDRSTRLEN] = "0.0.0.0";
+            if (getpeername(cqe.res, (sockaddr*)&cli, &len) == 0) inet_ntop(AF_INET, &cli.sin_addr, ip_str, sizeof(ip_str));
+            take_connection(w, cqe.res, ip_str);
+        } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+            errno = -cqe.res;
+            LOG_ERRNO("accept");
+        }
+        if (!more) arm_accept(ring, fd);
+        break;
+    case Op::Wake:
+        handle_storage_acks(w);
+        handle_spf_verdicts(w);
+        adopt_connections(w);
+        if (!more) arm_wake(ring, fd);
+        break;
+    case Op::Recv:
+        on_recv(w, ring, fd, cqe);
+        break;
+    case Op::Send:
+        on_send(w, ring, fd, cqe);
+        break;
+    case Op::Cancel:
+        break;
+    }
+}
+
+// Submits, for each fd that found the ring full, whatever its state still
+// calls for: the listener and eventfd polls, a close's cancel, the pending
+// send, and a recv armed or cancelled to match the session's pause
+static void retry_deferred(Worker& w, UringLoop& ring) {
+    for (int fd : ring.take_deferred()) {
+        UringLoop::Pending& p = ring.at(fd);
+        p.deferred = false;
+        if (fd == w.evfd) { arm_wake(ring, fd); continue; }
+        if (fd == w.listenFd) { arm_accept(ring, fd); continue; }
+        if (p.closing) {
+            if (p.recv || p.send) ring.cancel_all(fd);
+            continue;
+        }
+        if (!p.send && p.outOff < p.out.size()) ring.submit_send(fd);
+        ConnState* st = w.conns.find(fd);
+        if (!st) continue;
+        bool paused = st->throttled || st->inputFull;
+        if (!paused && !p.recv) ring.arm_recv(fd);
+        else if (paused && p.recv) uring_pause_reads(w, fd);
+    }
+}
+
+bool uring_supported() {
+    // Multishot recv arrived in 6.0
+    utsname u{};
+    int major = 0, minor = 0;
+    if (uname(&u) != 0 || std::sscanf(u.release, "%d.%d", &major, &minor) != 2 || major < 6) return false;
+    UringLoop probe;
+    return probe.init(8, 1, 64);
+}
+
+void uring_worker_loop(Worker* wptr, int id) {
+    Worker& w = *wptr;
+    UringLoop ring;
+    if (!ring.init(4096, static_cast<unsigned>(g_config.uring_buffers), static_cast<unsigned>(g_config.buf_sz))) {
+        LOG_ERRNO("io_uring setup");
+        LOG_WARN("Worker " << id << " falls back to epoll");
+        worker_loop(wptr, id);
+        return;
+    }
+    w.ring = &ring;
+    arm_wake(ring, w.evfd);
+    if (w.listenFd >= 0) arm_accept(ring, w.listenFd);
+    w.now = TimerWheel::Clock::now();
+    while (true) {
+        // Requests still waiting for an SQE are retried within a millisecond
+        int timeout = next_wakeup_ms(w);
+        if (ring.has_deferred() && (timeout < 0 || timeout > 1)) timeout = 1;
+        if (!ring.wait(timeout)) { LOG_ERRNO("io_uring_enter"); break; }
+        w.now = TimerWheel::Clock::now();
+        ring.drain([&](const io_uring_cqe& cqe) { on_completion(w, ring, cqe); });
+        retry_deferred(w, ring);
+        end_of_batch(w);
+    }
+    w.ring = nullptr;
+}
@@ -0,0 +1,169 @@
+#include "logger.h"
+#include "mpmc_queue.h"
+#include "metrics.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct LogRecord {
+    LogLevel level = LogLevel::Info;
+    std::chrono::system_clock::time_point time;
+    std::string text;
+};
+
+// Per-thread ring; owned by the registry so it outlives its thread
+struct LogRing {
+    explicit LogRing(size_t capacity) : records(capacity) {}
+    BoundedQueue<LogRecord> records;
+    std::atomic<uint64_t> dropped{0};
+    size_t sinceWake = 0;              // producer-only: pushes since the last nudge
+};
+
+static std::mutex g_rings_mtx;                       // guards g_rings (registration only)
+static std::vector<std::unique_ptr<LogRing>> g_rings;
+static std::atomic<bool> g_started{false};
+static std::atomic<bool> g_stopping{false};
+static std::mutex g_wake_mtx;
+static std::condition_variable g_wake;
+static std::thread g_writer;
+static int g_log_fd = STDERR_FILENO;
+
+static const size_t kRingCapacity = 8192;
+
+bool log_enabled(LogLevel level) {
+    return level >= g_config.log_level;
+}
+
+static const char* level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "DEBUG";
+        case LogLevel::Info:  return "INFO";
+        case LogLevel::Warn:  return "WARN";
+        case LogLevel::Error: return "ERROR";
+        case LogLevel::Off:   break;
+    }
+    return "";
+}
+
+static void format_record(const LogRecord& rec, std::string& out) {
+    std::time_t secs = std::chrono::system_clock::to_time_t(rec.time);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(rec.time.time_since_epoch()).count() % 1000;
+    std::tm tm;
+    localtime_r(&secs, &tm);
+    char stamp[48];
+    size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    std::snprintf(stamp + n, sizeof(stamp) - n, ".%03d %-5s ", static_cast<int>(ms), level_name(rec.level));
+    out += stamp;
+    out += rec.text;
+    out += '\n';
+}
+
+static void write_all(const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = write(g_log_fd, data.data() + off, data.size() - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        off += static_cast<size_t>(n);
+    }
+}
+
+static LogRing& thread_ring() {
+    thread_local LogRing* ring = nullptr;
+    if (!ring) {
+        std::lock_guard<std::mutex> lk(g_rings_mtx);
+        g_rings.push_back(std::make_unique<LogRing>(kRingCapacity));
+        ring = g_rings.back().get();
+    }
+    return *ring;
+}
+
+// Moves everything queued into one buffer; returns false if nothing was queued
+static bool drain(std::string& out) {
+    std::vector<LogRing*> rings;
+    {
+        std::lock_guard<std::mutex> lk(g_rings_mtx);
+        for (auto& r : g_rings) rings.push_back(r.get());
+    }
+    bool any = false;
+    LogRecord rec;
+    for (LogRing* ring : rings) {
+        while (ring->records.try_pop(rec)) {
+            format_record(rec, out);
+            any = true;
+        }
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            LogRecord note{LogLevel::Warn, std::chrono::system_clock::now(),
+                           "logger: dropped " + std::to_string(dropped) + " record(s), ring full"};
+            format_record(note, out);
+            any = true;
+        }
+    }
+    return any;
+}
+
+static void writer_loop() {
+    std::string batch;
+    while (true) {
+        bool stopping = g_stopping.load(std::memory_order_acquire);
+        batch.clear();
+        if (drain(batch)) {
+            write_all(batch);
+            continue;
+        }
+        if (stopping) return;
+        // Producers only wake us when a ring is filling up; otherwise a
+        // short timeout bounds how stale the log can get
+        std::unique_lock<std::mutex> lk(g_wake_mtx);
+        g_wake.wait_for(lk, std::chrono::milliseconds(50));
+    }
+}
+
+static void log_stop() {
+    if (!g_started.load()) return;
+    g_stopping.store(true, std::memory_order_release);
+    g_wake.notify_one();
+    if (g_writer.joinable()) g_writer.join();
+}
+
+void log_start() {
+    if (g_started.exchange(true)) return;
+    if (!g_config.log_file.empty()) {
+        int fd = open(g_config.log_file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0) g_log_fd = fd;
+        else LOG_ERRNO("log file " << g_config.log_file);
+    }
+    g_writer = std::thread(writer_loop);
+    std::atexit(log_stop);
+}
+
+void log_write(LogLevel level, std::string&& text) {
+    LogRecord rec{level, std::chrono::system_clock::now(), std::move(text)};
+    if (!g_started.load(std::memory_order_acquire)) {
+        std::string line;
+        format_record(rec, line);
+        write_all(line);
+        return;
+    }
+    LogRing& ring = thread_ring();
+    if (!ring.records.try_push(std::move(rec))) {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        metrics::add(metrics::kLogDropped);
+        g_wake.notify_one();
+        return;
+    }
+    // Nudge the writer when records pile up faster than its timeout drains them
+    if (++ring.sinceWake >= kRingCapacity / 4) {
+        ring.sinceWake = 0;
+        g_wake.notify_one();
+    }
+}
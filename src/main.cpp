@@ -16,102 +16,161 @@
 #include <sstream>
 #include <regex>
 #include <optional>
-#include <spf_check.h>
+#include <spf_engine.h>
+#include <dns_resolver.h>
 #include <postgres.h>
+#include <db_pool.h>
 #include <string_manipulation.h>
 #include <config.h>
 #include <types.h>
 #include <smtp_logic.h>
 #include <worker.h>
+#include <storage.h>
+#include <spool.h>
+#include <sys/eventfd.h>
+#include <dispatch.h>
+#include <logger.h>
+#include <io_uring_loop.h>
+#include <metrics.h>
 
 
 
-PostgresDB* g_db = nullptr;  // definition, global pointer
-
-int main() {
-        load_config("config.conf");
-   g_db = new PostgresDB(g_config.db_conn_str); // initialize dynamically
-    if (!g_db->connect()) {
-        std::cerr << "Fatal: could not connect to Postgres.\n";
-        return 1;
-    }
-        try {
-        g_db->init_prepared_statements();
-    } catch (const std::exception& e) {
-        std::cerr << "Failed to initialize prepared statements: " << e.what() << std::endl;
-        delete g_db;
-        return 1;
-    }
-    std::cout << "Database connection established.\n";
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) { perror("socket"); return 1; }
-     int one = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+// Listening socket on g_config.port; -1 on failure. Per-worker listeners
+// share the port with SO_REUSEPORT and are non-blocking; the single
+// acceptor thread's listener blocks in accept().
+static int open_listener(bool reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM | (reuseport ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0) { LOG_ERRNO("socket"); return -1; }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) { LOG_ERRNO("SO_REUSEPORT"); close(fd); return -1; }
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(g_config.port);
 
-    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-    if (listen(listen_fd, g_config.backlog) < 0) { perror("listen"); return 1; }
-    if (make_nonblocking(listen_fd) < 0) { perror("nonblock listen"); return 1; }
-
-    std::cout << "SMTP (epoll) listening on " << g_config.port << " with " << g_config.workers << " workers...\n";
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { LOG_ERRNO("bind"); close(fd); return -1; }
+    if (listen(fd, g_config.backlog) < 0) { LOG_ERRNO("listen"); close(fd); return -1; }
+    return fd;
+}
 
-    // Create workers (each has its own epoll instance and state)
+int main() {
+        load_config("config.conf");
+    log_start();
+    bool reuseport = g_config.accept_mode == "reuseport";
+    if (!reuseport && g_config.accept_mode != "acceptor") {
+        LOG_ERROR("Fatal: unknown accept_mode " << g_config.accept_mode);
+        return 1;
+    }
+    bool use_uring = g_config.event_loop == "io_uring";
+    if (!use_uring && g_config.event_loop != "epoll") {
+        LOG_ERROR("Fatal: unknown event_loop " << g_config.event_loop);
+        return 1;
+    }
+    if (use_uring && !uring_supported()) {
+        LOG_WARN("io_uring not available on this kernel, using epoll.");
+        use_uring = false;
+    }
+    // One pooled connection per storage thread unless configured otherwise
+    int pool_size = g_config.db_pool_size > 0 ? g_config.db_pool_size : g_config.storage_threads;
+    if (!g_config.spool_dir.empty()) {
+        size_t segment_bytes = static_cast<size_t>(g_config.spool_segment_mb) << 20;
+        g_spool = new Spool(g_config.spool_dir, segment_bytes, g_config.spool_fsync_ms);
+        if (!g_spool->open()) {
+            LOG_ERROR("Fatal: could not open spool directory " << g_config.spool_dir);
+            return 1;
+        }
+    }
+    if (g_config.dns_resolver == "zone") {
+        auto zone = std::make_unique<spf::ZoneResolver>(g_config.dns_mock_latency_us);
+        if (!zone->load(g_config.dns_zone_file)) {
+            LOG_ERROR("Fatal: could not load DNS zone file " << g_config.dns_zone_file);
+            return 1;
+        }
+        spf::set_resolver(std::move(zone));
+        LOG_INFO("SPF lookups answered from " << g_config.dns_zone_file);
+    }
+    g_db_pool = new DbPool(g_config.db_conn_str, pool_size, g_config.db_health_check_secs);
+    if (!g_db_pool->init()) {
+        // With a spool we can accept mail now and replay it once Postgres is back
+        if (!g_spool) {
+            LOG_ERROR("Fatal: could not connect to Postgres.");
+            delete g_db_pool;
+            return 1;
+        }
+        LOG_WARN("Postgres unavailable, spooling messages until it returns.");
+    } else {
+        LOG_INFO("Database connection established.");
+    }
+    // Create workers (each has its own epoll instance and state; io_uring
+    // workers fall back to the epoll set if their ring cannot be set up)
     std::vector<Worker> workers(g_config.workers);
     for (int i = 0; i < g_config.workers; ++i) {
+        workers[i].id = i;
         workers[i].epfd = epoll_create1(0);
-        if (workers[i].epfd < 0) { perror("epoll_create1"); return 1; }
+        if (workers[i].epfd < 0) { LOG_ERRNO("epoll_create1"); return 1; }
+
+        // Storage acks, SPF verdicts and handed-off connections arrive on
+        // lock-free rings; the eventfd wakes epoll
+        workers[i].incoming = std::make_unique<BoundedQueue<Handoff>>(g_config.handoff_queue_size);
+        workers[i].acks = std::make_unique<BoundedQueue<StorageAck>>(
+            g_config.storage_queue_size + g_config.storage_threads);
+        workers[i].spfVerdicts = std::make_unique<BoundedQueue<SpfVerdict>>(
+            g_config.spf_queue_size + g_config.spf_threads);
+        workers[i].evfd = eventfd(0, EFD_NONBLOCK);
+        if (workers[i].evfd < 0) { LOG_ERRNO("eventfd"); return 1; }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = workers[i].evfd;
+        if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].evfd, &ev) < 0) { LOG_ERRNO("epoll_ctl ADD eventfd"); return 1; }
+
+        // Every worker accepts on its own listener; the kernel spreads
+        // incoming connections across them
+        if (!reuseport) continue;
+        workers[i].listenFd = open_listener(true);
+        if (workers[i].listenFd < 0) return 1;
+        ev.data.fd = workers[i].listenFd;
+        if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].listenFd, &ev) < 0) { LOG_ERRNO("epoll_ctl ADD listener"); return 1; }
     }
+    int listen_fd = -1;
+    if (!reuseport && (listen_fd = open_listener(false)) < 0) return 1;
+
+    LOG_INFO("SMTP (" << (use_uring ? "io_uring" : "epoll") << ") listening on " << g_config.port << " with " << g_config.workers << " workers...");
+    dispatch_init(workers);
+    storage_start(workers);
+    spf_start(workers);
+    metrics::start(workers);
 
     std::vector<std::thread> threads;
     threads.reserve(g_config.workers);
     for (int i = 0; i < g_config.workers; ++i) {
-        threads.emplace_back(worker_loop, &workers[i], i);
+        threads.emplace_back(use_uring ? uring_worker_loop : worker_loop, &workers[i], i);
     }
 
-    // Accept loop (main thread) — round-robin assign each new client to a worker
-    int next = 0;
-    while (true) {
+    // Acceptor mode: this thread accepts and hands each client to the worker
+    // chosen by dispatch_policy; the worker creates the connection state itself
+    while (listen_fd >= 0) {
         sockaddr_in cli{};
         socklen_t len = sizeof(cli);
-        int cfd = accept(listen_fd, (sockaddr*)&cli, &len);
+        int cfd = accept4(listen_fd, (sockaddr*)&cli, &len, SOCK_NONBLOCK);
         if (cfd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // No pending connections; small sleep prevents busy loop when nonblocking accept
-                usleep(2000);
-                continue;
-            } else {
-                perror("accept");
-                break;
-            }
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_ERRNO("accept");
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) { usleep(10000); continue; }
+            break;
         }
-        make_nonblocking(cfd);
-          char ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(cli.sin_addr), ip_str, INET_ADDRSTRLEN);
-        // Send banner immediately (non-blocking best-effort)
-        send_line(cfd, "220 mx.distyn.com ESMTP PigeonX");
-
-        epoll_event ev{};
-        ev.events = EPOLLIN | EPOLLET; // edge-triggered for efficiency
-        ev.data.fd = cfd;
-
-        Worker& w = workers[next];
-        if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
-            perror("epoll_ctl ADD");
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(cli.sin_addr), ip_str, INET_ADDRSTRLEN);
+        if (!hand_off(pick_worker(nullptr), cfd, ip_str)) {
+            metrics::add(metrics::kConnectionsRefused);
+            send_line(cfd, "421 4.3.2 Service busy, try again later");
             close(cfd);
-            continue;
         }
-        // Initialize per-connection state map entry
-           
-        w.conns.emplace(cfd, ConnState{ip:ip_str});
-
-        next = (next + 1) % g_config.workers;
     }
 
     for (auto& t : threads) t.join();
-    close(listen_fd);
+    if (listen_fd >= 0) close(listen_fd);
+    for (auto& w : workers) if (w.listenFd >= 0) close(w.listenFd);
     return 0;
 }
@@ -0,0 +1,202 @@
+// message_view.cpp
+#include "message_view.h"
+#include "parser.h"
+#include <cctype>
+
+namespace mail {
+
+static const int kMaxDepth = 32; // nested multipart limit
+
+static inline bool ieq(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+static inline std::string_view trimView(std::string_view s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == std::string_view::npos) return {};
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+// Drops leading and trailing CR/LF only (body content keeps its spaces)
+static inline std::string_view trimNewlines(std::string_view s) {
+    size_t b = 0, e = s.size();
+    while (b < e && (s[b] == '\r' || s[b] == '\n')) ++b;
+    while (e > b && (s[e - 1] == '\r' || s[e - 1] == '\n')) --e;
+    return s.substr(b, e - b);
+}
+
+// --- HeaderTable ------------------------------------------------------------
+void HeaderTable::add(std::string_view name, std::string_view value) {
+    if (count < kInline) inlineFields[count] = HeaderField{name, value};
+    else overflow.push_back(HeaderField{name, value});
+    ++count;
+}
+
+void HeaderTable::clear() {
+    overflow.clear();
+    count = 0;
+}
+
+const HeaderField* HeaderTable::find(std::string_view name) const {
+    for (size_t i = count; i-- > 0;) {
+        const HeaderField& f = (*this)[i];
+        if (ieq(f.name, name)) return &f;
+    }
+    return nullptr;
+}
+
+std::string_view HeaderTable::raw(std::string_view name) const {
+    const HeaderField* f = find(name);
+    return f ? f->value : std::string_view();
+}
+
+void parseHeaderBlock(std::string_view block, HeaderTable& out) {
+    out.clear();
+    // Index of the field a continuation line extends, or -1
+    long current = -1;
+    size_t valueStart = 0;
+    size_t pos = 0;
+    while (pos < block.size()) {
+        size_t eol = block.find('\n', pos);
+        size_t lineEnd = (eol == std::string_view::npos) ? block.size() : eol;
+        std::string_view line = block.substr(pos, lineEnd - pos);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+        if (!line.empty() && (line[0] == ' ' || line[0] == '\t')) {
+            // folded header continuation: widen the value to this line
+            if (current >= 0) {
+                out.setValue(current, trimView(block.substr(valueStart, pos + line.size() - valueStart)));
+            }
+        } else {
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos) {
+                std::string_view name = trimView(line.substr(0, colon));
+                valueStart = pos + colon + 1;
+                out.add(name, trimView(line.substr(colon + 1)));
+                current = static_cast<long>(out.size()) - 1;
+            } else {
+                current = -1; // ignore malformed lines
+            }
+        }
+        if (eol == std::string_view::npos) break;
+        pos = eol + 1;
+    }
+}
+
+std::string unfold(std::string_view value) {
+    std::string out;
+    out.reserve(value.size());
+    size_t i = 0;
+    while (i < value.size()) {
+        char c = value[i];
+        if (c == '\r' || c == '\n') {
+            // line break plus the continuation's leading whitespace -> one space
+            while (i < value.size() && (value[i] == '\r' || value[i] == '\n' ||
+                                        value[i] == ' ' || value[i] == '\t')) ++i;
+            out.push_back(' ');
+            continue;
+        }
+        out.push_back(c);
+        ++i;
+    }
+    return out;
+}
+
+void splitEntity(std::string_view entity, std::string_view& headers, std::string_view& body) {
+    size_t pos = 0;
+    while (pos < entity.size()) {
+        size_t eol = entity.find('\n', pos);
+        if (eol == std::string_view::npos) break;
+        size_t next = eol + 1;
+        // Blank line: "\n" or "\r\n" straight after the previous line end
+        if (next < entity.size() && entity[next] == '\n') {
+            headers = entity.substr(0, eol);
+            body = entity.substr(next + 1);
+            return;
+        }
+        if (next + 1 < entity.size() && entity[next] == '\r' && entity[next + 1] == '\n') {
+            headers = entity.substr(0, eol);
+            body = entity.substr(next + 2);
+            return;
+        }
+        pos = next;
+    }
+    headers = entity;
+    body = std::string_view();
+}
+
+// --- MessageView ------------------------------------------------------------
+MessageView::MessageView(std::string buffer)
+    : owned(std::make_unique<const std::string>(std::move(buffer))) {
+    data = *owned;
+    parse();
+}
+
+MessageView MessageView::borrow(std::string_view buffer) {
+    MessageView v;
+    v.data = buffer;
+    v.parse();
+    return v;
+}
+
+void MessageView::parse() {
+    std::string_view hdrBlock;
+    splitEntity(data, hdrBlock, topBody);
+    parseHeaderBlock(hdrBlock, top);
+    walk(top, topBody, 0);
+}
+
+void MessageView::walk(const HeaderTable& headers, std::string_view body, int depth) {
+    std::string_view ct = headers.raw("content-type");
+    std::string lct = Parser::toLower(std::string(ct));
+
+    if (depth < kMaxDepth && lct.find("multipart/") != std::string::npos) {
+        std::string boundary = Parser::extractParameter(unfold(ct), "boundary");
+        if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+            boundary = boundary.substr(1, boundary.size() - 2);
+        }
+        if (!boundary.empty()) {
+            std::string delim = "--" + boundary;
+            size_t partStart = std::string_view::npos;
+            size_t pos = 0;
+            while (pos < body.size()) {
+                size_t hit = body.find(delim, pos);
+                if (hit == std::string_view::npos) break;
+                if (hit != 0 && body[hit - 1] != '\n') { pos = hit + 1; continue; } // not at line start
+
+                if (partStart != std::string_view::npos) {
+                    std::string_view part = body.substr(partStart, hit - partStart);
+                    // Parts starting with a blank line carry no headers and are skipped
+                    if (!part.empty() && part[0] != '\n' && !(part[0] == '\r' && part.size() > 1 && part[1] == '\n')) {
+                        std::string_view ph, pb;
+                        splitEntity(part, ph, pb);
+                        HeaderTable partHeaders;
+                        parseHeaderBlock(ph, partHeaders);
+                        walk(partHeaders, pb, depth + 1);
+                    }
+                }
+
+                size_t after = hit + delim.size();
+                if (body.compare(after, 2, "--") == 0) return; // close delimiter
+                size_t eol = body.find('\n', after);
+                if (eol == std::string_view::npos) return;
+                partStart = eol + 1;
+                pos = partStart;
+            }
+            return;
+        }
+        // No boundary: the body is kept as a single (plain text) leaf
+    }
+
+    PartView leaf;
+    leaf.headers = headers;
+    leaf.body = trimNewlines(body);
+    leaves.push_back(std::move(leaf));
+}
+
+} // namespace mail
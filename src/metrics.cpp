@@ -0,0 +1,298 @@
+#include "metrics.h"
+#include "config.h"
+#include "logger.h"
+#include "spf_check.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace metrics {
+
+// Log-linear buckets in nanoseconds: each power of two is split into
+// kSub equal sub-buckets, so a bucket is at most 1/kSub of its value wide
+// (HDR histogram style, ~12% precision) from 1 ns up to 2^64 ns.
+static constexpr int kSubBits = 3;
+static constexpr int kSub = 1 << kSubBits;
+static constexpr int kBuckets = (64 - kSubBits + 1) * kSub;
+
+static int bucket_of(uint64_t ns) {
+    if (ns < static_cast<uint64_t>(kSub)) return static_cast<int>(ns);
+    int e = 63 - __builtin_clzll(ns);
+    return (e - kSubBits + 1) * kSub + static_cast<int>((ns >> (e - kSubBits)) & (kSub - 1));
+}
+
+// Largest value that falls in `bucket`
+static uint64_t bucket_max(int bucket) {
+    if (bucket < kSub) return static_cast<uint64_t>(bucket);
+    int e = bucket / kSub + kSubBits - 1;
+    uint64_t width = uint64_t(1) << (e - kSubBits);
+    return ((static_cast<uint64_t>(kSub + bucket % kSub)) << (e - kSubBits)) + width - 1;
+}
+
+struct HistogramData {
+    std::atomic<uint64_t> buckets[kBuckets];
+    std::atomic<uint64_t> sumNs;
+};
+
+// One thread's recordings. Only the owner writes; scrapes read.
+struct Shard {
+    std::atomic<uint64_t> counters[kCounterCount];
+    HistogramData histograms[kHistogramCount];
+};
+
+static std::mutex g_shards_mtx;
+static std::vector<Shard*> g_shards;   // never freed: a finished thread's counts still count
+static std::vector<Worker>* g_workers = nullptr;
+
+static Shard& local_shard() {
+    thread_local Shard* shard = nullptr;
+    if (!shard) {
+        shard = new Shard(); // value-initialised: all zero
+        std::lock_guard<std::mutex> lk(g_shards_mtx);
+        g_shards.push_back(shard);
+    }
+    return *shard;
+}
+
+// Single writer, so a relaxed load and store is enough
+static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void add(Counter c, uint64_t n) {
+    bump(local_shard().counters[c], n);
+}
+
+void observe(Histogram h, std::chrono::nanoseconds elapsed) {
+    uint64_t ns = elapsed.count() > 0 ? static_cast<uint64_t>(elapsed.count()) : 0;
+    HistogramData& d = local_shard().histograms[h];
+    bump(d.buckets[bucket_of(ns)], 1);
+    bump(d.sumNs, ns);
+}
+
+// --- exposition -------------------------------------------------------------
+struct Desc {
+    const char* name;
+    const char* labels;
+    const char* help;
+};
+
+static const Desc kCounters[] = {
+    {"pigeonx_connections_accepted_total", "", "SMTP sessions started."},
+    {"pigeonx_connections_refused_total", "", "Connections turned away with 421 because every worker queue was full."},
+    {"pigeonx_connections_timed_out_total", "", "Sessions closed by a greeting, command, data or idle timeout."},
+    {"pigeonx_bytes_received_total", "", "Bytes read from SMTP clients."},
+    {"pigeonx_messages_total", "outcome=\"accepted\"", "Messages by storage outcome."},
+    {"pigeonx_messages_total", "outcome=\"tempfail\"", nullptr},
+    {"pigeonx_messages_total", "outcome=\"rejected\"", nullptr},
+    {"pigeonx_mail_refused_total", "reason=\"size\"", "Transactions refused before storage."},
+    {"pigeonx_mail_refused_total", "reason=\"memory_budget\"", nullptr},
+    {"pigeonx_spf_results_total", "result=\"none\"", "SPF check_host results."},
+    {"pigeonx_spf_results_total", "result=\"neutral\"", nullptr},
+    {"pigeonx_spf_results_total", "result=\"pass\"", nullptr},
+    {"pigeonx_spf_results_total", "result=\"fail\"", nullptr},
+    {"pigeonx_spf_results_total", "result=\"softfail\"", nullptr},
+    {"pigeonx_spf_results_total", "result=\"temperror\"", nullptr},
+    {"pigeonx_spf_results_total", "result=\"permerror\"", nullptr},
+    {"pigeonx_db_rollbacks_total", "", "Database transactions rolled back."},
+    {"pigeonx_spool_dead_letters_total", "", "Accepted messages moved to the spool's dead-letter directory."},
+    {"pigeonx_log_dropped_total", "", "Log records dropped because a logger ring was full."},
+};
+static_assert(sizeof(kCounters) / sizeof(kCounters[0]) == kCounterCount, "one Desc per Counter");
+
+static const Desc kHistograms[] = {
+    {"pigeonx_read_batch_seconds", "", "Time to receive and act on one readiness event of a session."},
+    {"pigeonx_spf_check_seconds", "", "SPF check_host time, DNS lookups included."},
+    {"pigeonx_parse_seconds", "", "Whole-message MIME parse time."},
+    {"pigeonx_db_transaction_seconds", "", "Database transaction time, begin to commit."},
+};
+static_assert(sizeof(kHistograms) / sizeof(kHistograms[0]) == kHistogramCount, "one Desc per Histogram");
+
+static void append_help(std::string& out, const char* name, const char* help, const char* type) {
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+static void append_sample(std::string& out, const char* name, const char* suffix,
+                          const std::string& labels, double value) {
+    char num[32];
+    std::snprintf(num, sizeof(num), "%.9g", value);
+    out += name; out += suffix;
+    if (!labels.empty()) { out += '{'; out += labels; out += '}'; }
+    out += ' '; out += num; out += '\n';
+}
+
+static std::string label(const char* key, const std::string& value) {
+    return std::string(key) + "=\"" + value + "\"";
+}
+
+// Cumulative buckets at powers of two from ~1 us to ~69 s (exact bucket
+// edges of the HDR layout), plus quantiles read off the full resolution
+static void append_histogram(std::string& out, const Desc& d, const uint64_t* buckets, uint64_t sumNs) {
+    append_help(out, d.name, d.help, "histogram");
+    uint64_t total = 0;
+    for (int b = 0; b < kBuckets; ++b) total += buckets[b];
+    uint64_t below = 0;
+    int b = 0;
+    for (int k = 10; k <= 36; ++k) {
+        int edge = (k - kSubBits + 1) * kSub; // first bucket at or above 2^k ns
+        for (; b < edge; ++b) below += buckets[b];
+        char le[32];
+        std::snprintf(le, sizeof(le), "%.9g", static_cast<double>(uint64_t(1) << k) / 1e9);
+        append_sample(out, d.name, "_bucket", label("le", le), static_cast<double>(below));
+    }
+    append_sample(out, d.name, "_bucket", label("le", "+Inf"), static_cast<double>(total));
+    append_sample(out, d.name, "_sum", "", static_cast<double>(sumNs) / 1e9);
+    append_sample(out, d.name, "_count", "", static_cast<double>(total));
+
+    std::string qname = std::string(d.name) + "_quantile";
+    append_help(out, qname.c_str(), "Latency quantiles since startup.", "gauge");
+    for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total));
+        uint64_t seen = 0;
+        double value = 0;
+        for (int i = 0; i < kBuckets && total > 0; ++i) {
+            seen += buckets[i];
+            if (seen > rank) { value = static_cast<double>(bucket_max(i)) / 1e9; break; }
+        }
+        char qs[16];
+        std::snprintf(qs, sizeof(qs), "%g", q);
+        append_sample(out, qname.c_str(), "", label("quantile", qs), value);
+    }
+}
+
+std::string render() {
+    uint64_t counters[kCounterCount] = {};
+    std::vector<uint64_t> buckets(static_cast<size_t>(kHistogramCount) * kBuckets, 0);
+    uint64_t sums[kHistogramCount] = {};
+    {
+        std::lock_guard<std::mutex> lk(g_shards_mtx);
+        for (const Shard* s : g_shards) {
+            for (int c = 0; c < kCounterCount; ++c) counters[c] += s->counters[c].load(std::memory_order_relaxed);
+            for (int h = 0; h < kHistogramCount; ++h) {
+                const HistogramData& d = s->histograms[h];
+                for (int b = 0; b < kBuckets; ++b) buckets[h * kBuckets + b] += d.buckets[b].load(std::memory_order_relaxed);
+                sums[h] += d.sumNs.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::string out;
+    out.reserve(16 * 1024);
+    for (int c = 0; c < kCounterCount; ++c) {
+        const Desc& d = kCounters[c];
+        if (d.help) append_help(out, d.name, d.help, "counter");
+        append_sample(out, d.name, "", d.labels, static_cast<double>(counters[c]));
+    }
+    for (int h = 0; h < kHistogramCount; ++h) {
+        append_histogram(out, kHistograms[h], &buckets[h * kBuckets], sums[h]);
+    }
+
+    spf::CacheStats cache = spf::cache_stats();
+    append_help(out, "pigeonx_spf_cache_lookups_total", "SPF record and DNS answer cache lookups.", "counter");
+    const struct { const char* cache; uint64_t hits, misses; } caches[] = {
+        {"policy", cache.policy_hits, cache.policy_misses},
+        {"address", cache.address_hits, cache.address_misses},
+        {"mx", cache.mx_hits, cache.mx_misses},
+    };
+    for (const auto& c : caches) {
+        append_sample(out, "pigeonx_spf_cache_lookups_total", "", label("cache", c.cache) + ",result=\"hit\"", static_cast<double>(c.hits));
+        append_sample(out, "pigeonx_spf_cache_lookups_total", "", label("cache", c.cache) + ",result=\"miss\"", static_cast<double>(c.misses));
+    }
+
+    if (g_workers) {
+        const struct { const char* name; const char* help; } gauges[] = {
+            {"pigeonx_worker_sessions", "Open sessions per worker."},
+            {"pigeonx_worker_handoff_queued", "Connections handed to a worker, not yet adopted."},
+            {"pigeonx_worker_pending_jobs", "Storage jobs and SPF checks in flight per worker."},
+            {"pigeonx_worker_buffered_bytes", "Session data and messages queued for storage, per worker."},
+        };
+        for (int g = 0; g < 4; ++g) {
+            append_help(out, gauges[g].name, gauges[g].help, "gauge");
+            for (const Worker& w : *g_workers) {
+                double v = 0;
+                switch (g) {
+                    case 0: v = w.load.conns.load(std::memory_order_relaxed); break;
+                    case 1: v = w.load.queued.load(std::memory_order_relaxed); break;
+                    case 2: v = w.load.pending.load(std::memory_order_relaxed); break;
+                    case 3: v = static_cast<double>(w.load.buffered.load(std::memory_order_relaxed)); break;
+                }
+                append_sample(out, gauges[g].name, "", label("worker", std::to_string(w.id)), v);
+            }
+        }
+    }
+    return out;
+}
+
+// --- scrape endpoint --------------------------------------------------------
+// One request per connection, answered in line: scrapes are rare and
+// cheap, so a single blocking thread is plenty
+static void serve_scrapes(int listenFd) {
+    while (true) {
+        int c = accept(listenFd, nullptr, nullptr);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            LOG_ERRNO("metrics accept");
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        timeval tv{2, 0}; // a stalled scraper must not hold the thread
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        std::string req;
+        char buf[1024];
+        while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192) {
+            ssize_t n = recv(c, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            req.append(buf, static_cast<size_t>(n));
+        }
+        bool found = req.rfind("GET /metrics", 0) == 0 && req.size() > 12 && (req[12] == ' ' || req[12] == '?');
+        std::string body = found ? render() : "Not found\n";
+        std::string resp = found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n";
+        resp += found ? "Content-Type: text/plain; version=0.0.4\r\n" : "Content-Type: text/plain\r\n";
+        resp += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        resp += body;
+
+        size_t sent = 0;
+        while (sent < resp.size()) {
+            ssize_t n = send(c, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += static_cast<size_t>(n);
+        }
+        close(c);
+    }
+}
+
+void start(std::vector<Worker>& workers) {
+    g_workers = &workers;
+    if (g_config.metrics_port <= 0) return;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { LOG_ERRNO("metrics socket"); return; }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_config.metrics_port);
+    if (inet_pton(AF_INET, g_config.metrics_bind.c_str(), &addr.sin_addr) != 1) {
+        LOG_ERROR("metrics_bind is not an IPv4 address: " << g_config.metrics_bind);
+        close(fd);
+        return;
+    }
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        LOG_ERRNO("metrics listen");
+        close(fd);
+        return;
+    }
+    std::thread(serve_scrapes, fd).detach();
+    LOG_INFO("Metrics on http://" << g_config.metrics_bind << ":" << g_config.metrics_port << "/metrics");
+}
+
+} // namespace metrics
@@ -0,0 +1,241 @@
+// mime_codec.cpp
+#include "mime_codec.h"
+#include <array>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MIME_CODEC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace mail {
+
+// --- lookup tables ----------------------------------------------------------
+// base64 alphabet value, or -1 for anything the decoder skips
+static constexpr std::array<int8_t, 256> makeB64Table() {
+    std::array<int8_t, 256> t{};
+    for (int i = 0; i < 256; ++i) t[i] = -1;
+    for (int i = 0; i < 26; ++i) { t['A' + i] = int8_t(i); t['a' + i] = int8_t(26 + i); }
+    for (int i = 0; i < 10; ++i) t['0' + i] = int8_t(52 + i);
+    t['+'] = 62;
+    t['/'] = 63;
+    return t;
+}
+static constexpr std::array<int8_t, 256> kB64 = makeB64Table();
+
+static constexpr std::array<int8_t, 256> makeHexTable() {
+    std::array<int8_t, 256> t{};
+    for (int i = 0; i < 256; ++i) t[i] = -1;
+    for (int i = 0; i < 10; ++i) t['0' + i] = int8_t(i);
+    for (int i = 0; i < 6; ++i) { t['a' + i] = int8_t(10 + i); t['A' + i] = int8_t(10 + i); }
+    return t;
+}
+static constexpr std::array<int8_t, 256> kHex = makeHexTable();
+
+// --- base64 kernels ---------------------------------------------------------
+// A kernel decodes whole blocks of alphabet characters and stops at the
+// first block containing anything else (CR/LF, '=', junk), returning the
+// number of input bytes consumed. 4 input bytes become 3 output bytes, but
+// each block store writes a full vector, so `out` needs 32 bytes of slack.
+using Base64Kernel = size_t (*)(const char* in, size_t len, char* out);
+
+#ifdef MIME_CODEC_X86
+// Classification and translation follow the nibble-lookup scheme of
+// Muła and Lemire: a byte is valid iff lut_lo[low nibble] & lut_hi[high
+// nibble] is zero, and its sextet is the byte plus lut_roll[high nibble]
+// (with '/' singled out).
+__attribute__((target("ssse3")))
+static size_t decodeSsse3(const char* in, size_t len, char* out) {
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2F);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t i = 0;
+    while (len - i >= 16) {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask2F);
+        __m128i loNibbles = _mm_and_si128(str, mask2F);
+        __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+        __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) break;
+
+        __m128i eq2F = _mm_cmpeq_epi8(str, mask2F);
+        __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+        str = _mm_add_epi8(str, roll);
+
+        // 4x6 bits -> 3 bytes per 32-bit lane, then squeeze out the gaps
+        __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(merged, pack));
+        out += 12;
+        i += 16;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t decodeAvx2(const char* in, size_t len, char* out) {
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                           0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71,
+                                             0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    size_t i = 0;
+    while (len - i >= 32) {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask2F);
+        __m256i loNibbles = _mm256_and_si256(str, mask2F);
+        __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+        __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256())) != 0) break;
+
+        __m256i eq2F = _mm256_cmpeq_epi8(str, mask2F);
+        __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        // 12 bytes sit at the bottom of each 128-bit lane; join them
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(merged, lanes));
+        out += 24;
+        i += 32;
+    }
+    // A 16-byte tail (or a bad second half) still gets one SSSE3 try. The
+    // SSSE3 kernel is legacy-SSE encoded: clear the upper ymm halves first or
+    // every one of its instructions pays an AVX-SSE transition penalty.
+    _mm256_zeroupper();
+    return i + decodeSsse3(in + i, len - i, out);
+}
+#endif
+
+// Best kernel this CPU runs, or the one named by `want` if it can
+static bool pickKernel(const char* want, const char** name, Base64Kernel* kernel) {
+    auto wanted = [&](const char* n) { return !want || std::strcmp(want, n) == 0; };
+#ifdef MIME_CODEC_X86
+    __builtin_cpu_init();
+    if (wanted("avx2") && __builtin_cpu_supports("avx2")) { *name = "avx2"; *kernel = decodeAvx2; return true; }
+    if (wanted("ssse3") && __builtin_cpu_supports("ssse3")) { *name = "ssse3"; *kernel = decodeSsse3; return true; }
+#endif
+    if (!wanted("scalar")) return false;
+    *name = "scalar";
+    *kernel = nullptr;
+    return true;
+}
+
+struct KernelChoice {
+    const char* name = "scalar";
+    Base64Kernel kernel = nullptr;
+    KernelChoice() { pickKernel(nullptr, &name, &kernel); }
+};
+
+static KernelChoice& kernelChoice() {
+    static KernelChoice choice;
+    return choice;
+}
+
+const char* base64Backend() {
+    return kernelChoice().name;
+}
+
+bool setBase64Backend(const char* name) {
+    KernelChoice& c = kernelChoice();
+    return pickKernel(name, &c.name, &c.kernel);
+}
+
+// --- base64 driver ----------------------------------------------------------
+void base64Decode(const char* in, size_t len, std::string& out, Base64State& st) {
+    Base64Kernel kernel = kernelChoice().kernel;
+
+    size_t base = out.size();
+    out.resize(base + (len / 4) * 3 + 3 + 32);
+    char* o = &out[base];
+
+    // Locals, so stores through `o` don't force reloads of the state
+    uint32_t val = st.val;
+    int bits = st.bits;
+    size_t i = 0;
+    while (i < len) {
+        // Vector blocks need a quantum boundary: no bits carried over
+        if (kernel && bits == -8) {
+            size_t done = kernel(in + i, len - i, o);
+            i += done;
+            o += (done / 4) * 3;
+            if (i >= len) break;
+        }
+        // Scalar until the rejected byte is behind us and the quantum is
+        // complete again; for MIME that is the CRLF at the end of each line
+        bool skipped = false;
+        while (i < len) {
+            int v = kB64[static_cast<unsigned char>(in[i++])];
+            if (v < 0) {
+                skipped = true; // padding, whitespace, junk
+            } else {
+                val = (val << 6) | uint32_t(v);
+                bits += 6;
+                if (bits >= 0) {
+                    *o++ = char((val >> bits) & 0xFF);
+                    bits -= 8;
+                }
+            }
+            if (skipped && bits == -8) {
+                // swallow the rest of a CRLF / whitespace run in one go
+                while (i < len && kB64[static_cast<unsigned char>(in[i])] < 0) ++i;
+                break;
+            }
+        }
+    }
+    st.val = val;
+    st.bits = bits;
+    out.resize(o - out.data());
+}
+
+// --- quoted-printable -------------------------------------------------------
+// Literal runs are copied whole; memchr does the vector scan for '='.
+void qpDecode(const char* in, size_t len, std::string& out) {
+    out.reserve(out.size() + len);
+    size_t i = 0;
+    while (i < len) {
+        const char* eq = static_cast<const char*>(std::memchr(in + i, '=', len - i));
+        size_t run = eq ? size_t(eq - (in + i)) : len - i;
+        out.append(in + i, run);
+        i += run;
+        if (!eq) break;
+
+        // soft line break: '=' followed by newline -> remove both and continue
+        if (i + 1 < len && in[i + 1] == '\n') { i += 2; continue; }
+        if (i + 2 < len && in[i + 1] == '\r' && in[i + 2] == '\n') { i += 3; continue; }
+        // hex form =XX
+        if (i + 2 < len) {
+            int hi = kHex[static_cast<unsigned char>(in[i + 1])];
+            int lo = kHex[static_cast<unsigned char>(in[i + 2])];
+            if (hi >= 0 && lo >= 0) {
+                out.push_back(static_cast<char>(hi << 4 | lo));
+                i += 3;
+                continue;
+            }
+        }
+        // fallback: append '=' literally
+        out.push_back('=');
+        ++i;
+    }
+}
+
+} // namespace mail
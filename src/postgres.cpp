@@ -1,7 +1,10 @@
 #include "postgres.h"
+#include "logger.h"
+#include "metrics.h"
 #include <iostream>
 #include <config.h>
 #include <stdexcept>
+#include <atomic>
 
 PostgresDB::PostgresDB(const std::string &connectionStr)
     : connStr(connectionStr), conn(nullptr), tx(nullptr) {}
@@ -14,19 +17,19 @@ bool PostgresDB::connect() {
     if (conn && conn->is_open()) {
         return true;
     }
-    std::cout << "DB string: [" << g_config.db_conn_str << "]\n";
+    LOG_DEBUG("DB string: [" << g_config.db_conn_str << "]");
     try {
         conn = std::make_unique<pqxx::connection>(connStr);
         if (conn->is_open()) {
-            std::cout << "Connected to database successfully." << std::endl;
+            LOG_INFO("Connected to database successfully.");
             return true;
         } else {
-            std::cerr << "Failed to open database connection." << std::endl;
+            LOG_ERROR("Failed to open database connection.");
             conn.reset();
             return false;
         }
     } catch (const std::exception &e) {
-        std::cerr << "Connection error: " << e.what() << std::endl;
+        LOG_ERROR("Connection error: " << e.what());
         conn.reset();
         return false;
     }
@@ -42,6 +45,32 @@ bool PostgresDB::isConnected() const {
     return conn && conn->is_open();
 }
 
+bool PostgresDB::ping() {
+    if (!isConnected() || tx) return false;
+    try {
+        pqxx::nontransaction txn(*conn);
+        txn.exec("SELECT 1");
+        return true;
+    } catch (const std::exception &e) {
+        LOG_ERROR("Ping failed: " << e.what());
+        return false;
+    }
+}
+
+bool PostgresDB::reconnect() {
+    tx.reset();
+    disconnect();
+    if (!connect()) return false;
+    try {
+        init_prepared_statements();
+    } catch (const std::exception &e) {
+        LOG_ERROR("Failed to initialize prepared statements: " << e.what());
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
 // --- Transaction Management ---
 void PostgresDB::begin() {
     if (!conn) {
@@ -51,6 +80,7 @@ void PostgresDB::begin() {
         throw std::runtime_error("A transaction is already active.");
     }
     tx = std::make_unique<pqxx::work>(*conn);
+    txStart = std::chrono::steady_clock::now();
 }
 
 void PostgresDB::commit() {
@@ -59,19 +89,28 @@ void PostgresDB::commit() {
     }
     tx->commit();
     tx.reset();
+    metrics::observe(metrics::kDbTransaction, std::chrono::steady_clock::now() - txStart);
 }
 
 void PostgresDB::rollback() {
     if (tx) {
+        metrics::add(metrics::kDbRollbacks);
         try {
             tx->abort();
         } catch (const std::exception& e) {
-            std::cerr << "Rollback failed: " << e.what() << std::endl;
+            LOG_ERROR("Rollback failed: " << e.what());
         }
         tx.reset();
     }
 }
 
+pqxx::work& PostgresDB::transaction() {
+    if (!tx) {
+        throw std::runtime_error("No active transaction.");
+    }
+    return *tx;
+}
+
 // --- Query Execution & Result Handling ---
 // New method to prepare a statement
 void PostgresDB::prepare(const std::string& query_name, const std::string& query_text) {
@@ -118,7 +157,7 @@ std::vector<std::unordered_map<std::string, std::string>> PostgresDB::query(cons
             results.push_back(rowMap);
         }
     } catch (const std::exception &e) {
-        std::cerr << "Query fetch error: " << e.what() << std::endl;
+        LOG_ERROR("Query fetch error: " << e.what());
     }
     return results;
 }
@@ -127,14 +166,64 @@ std::string PostgresDB::escape(const std::string &input) {
     if (!isConnected()) return "";
     return conn->esc(input);
 }
+void PostgresDB::ensure_schema() {
+    static std::atomic<bool> done{false};
+    if (done.load()) return;
+    if (!conn) {
+        throw std::runtime_error("Cannot update schema: not connected to the database.");
+    }
+    pqxx::work txn(*conn);
+    // Content address for attachment deduplication (NULL for legacy rows)
+    txn.exec("ALTER TABLE files ADD COLUMN IF NOT EXISTS sha256 bytea");
+    txn.exec("CREATE UNIQUE INDEX IF NOT EXISTS files_sha256_key ON files (sha256)");
+    // A deduplicated blob is shared by messages that may each name and type
+    // it differently, so the name and type live on the link. Legacy links
+    // take theirs from the files row once, when the columns are added.
+    pqxx::result linkMeta = txn.exec(
+        "SELECT 1 FROM information_schema.columns "
+        "WHERE table_name = 'email_attachments' AND column_name = 'filename'");
+    if (linkMeta.empty()) {
+        txn.exec("ALTER TABLE email_attachments ADD COLUMN IF NOT EXISTS filename text, "
+                 "ADD COLUMN IF NOT EXISTS content_type text");
+        txn.exec("UPDATE email_attachments a SET filename = f.filename, content_type = f.content_type "
+                 "FROM files f WHERE f.id = a.file_id AND a.filename IS NULL");
+    }
+    txn.exec("ALTER TABLE files ALTER COLUMN filename DROP NOT NULL, ALTER COLUMN content_type DROP NOT NULL");
+    txn.commit();
+    done.store(true);
+}
+
 void PostgresDB::init_prepared_statements() {
     if (!conn) {
         throw std::runtime_error("Cannot initialize prepared statements: not connected to the database.");
     }
+    ensure_schema();
 
-    // This query is for inserting attachments
+    // Main message row; $3 is a text[] and $4 arrives in binary format
+    conn->prepare(
+        "email_insert",
+        "INSERT INTO emails (sender, senderName, recipients, raw_body, subject, plain_text_body, html_body) "
+        "VALUES ($1, $2, $3, $4, $5, $6, $7) RETURNING id;"
+    );
+
+    // Attachment lookup by content hash; only the 32-byte digest is sent
+    conn->prepare(
+        "file_lookup",
+        "SELECT id FROM files WHERE sha256 = $1;"
+    );
+
+    // This query is for inserting attachment blobs. A concurrent insert of
+    // the same blob resolves to the existing row instead of a second copy.
     conn->prepare(
         "file_insert",
-        "INSERT INTO files (filename, content_type, content) VALUES ($1, $2, $3) RETURNING id;"
+        "INSERT INTO files (content, sha256) VALUES ($1, $2) "
+        "ON CONFLICT (sha256) DO UPDATE SET sha256 = EXCLUDED.sha256 RETURNING id;"
+    );
+
+    // Links an attachment to its message, with the name and type this
+    // message gave it
+    conn->prepare(
+        "email_attachment_link",
+        "INSERT INTO email_attachments (email_id, file_id, filename, content_type) VALUES ($1, $2, $3, $4);"
     );
 }
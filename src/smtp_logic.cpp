@@ -1,155 +1,282 @@
 #include "smtp_logic.h"
 #include "string_manipulation.h"
+#include "logger.h"
 #include <iostream>
 #include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <cctype>
 #include <regex>
 #include <sys/socket.h>
 #include <unistd.h>
-#include "spf_check.h"
-#include <parser.h>
-#include <pqxx/pqxx> 
+#include "spf_engine.h"
+#include "metrics.h"
+#include <storage.h>
+#include <types.h>
+#include <config.h>
+#include <worker.h>
 std::mutex g_fileMutex;
 
-
-struct ConnState {
-    bool inData = false;
-    std::string inbuf;                 // accumulate bytes; parse by CRLF
-    std::ostringstream dataBuffer;
-    std::string sender;
-    std::vector<std::string> recipients;
-    std::string ip;
-};
-
 void send_line(int fd, const std::string& s) {
-    std::cout << "S: " << s << std::endl;
+    LOG_PROTOCOL("S: " << s);
     std::string out = s + "\r\n";
-    ssize_t n = send(fd, out.data(), out.size(), 0);
+    ssize_t n = send(fd, out.data(), out.size(), MSG_NOSIGNAL);
     (void)n;
 }
 
-void process_smtp_line(ConnState& st, int fd, const std::string& raw) {
-    std::string line = raw;
-    rstrip_crlf(line);
-    mail::EmailMessage msg;
-    // DATA state
-    if (st.inData) {
-  if (line == ".") {
-        st.inData = false;
-        
-        // Step 1: Parse the raw email data
-        mail::EmailMessage parsedBody = mail::Parser::parse(st.dataBuffer.str());
-
-        // Step 2: Use a transaction for atomicity
-        g_db->begin();
-
-        try {
-            // Step 3: Insert the main email data into the 'emails' table
-            std::string escSender = g_db->escape(st.sender);
-            std::ostringstream recArray;
-            recArray << "{";
-            for (size_t i = 0; i < st.recipients.size(); ++i) {
-                if (i > 0) recArray << ",";
-                recArray << "\"" << g_db->escape(st.recipients[i]) << "\"";
-            }
-            recArray << "}";
-
-            std::string escSubject = g_db->escape(parsedBody.subject);
-            std::string escPlainText = g_db->escape(parsedBody.plainTextBody.value_or(""));
-            std::string escHtmlBody = g_db->escape(parsedBody.htmlBody.value_or(""));
-            std:: string escSenderName = g_db->escape(parsedBody.senderName.value_or(""));
-            std::string escRawBody = g_db->escape(st.dataBuffer.str());
-
-            std::ostringstream q_email;
-            q_email << "INSERT INTO emails (sender, senderName, recipients, raw_body, subject, plain_text_body, html_body) "
-                    << "VALUES ('" << escSender << "', '" << escSenderName << "', '" << recArray.str() << "', '" << escRawBody
-                    << "', '" << escSubject << "', '" << escPlainText << "', '" << escHtmlBody << "') "
-                    << "RETURNING id;";
-            
-            pqxx::result emailResult = g_db->execute(q_email.str());
-            int emailId = g_db->getInsertedId(emailResult);
-
-            // Prepare the statement for file insertion once per transaction
-
-            // Step 4: Loop through and insert each attachment
-            for (const auto& attachment : parsedBody.attachments) {
-                std::string escFilename = g_db->escape(attachment.filename);
-                std::string escContentType = g_db->escape(attachment.contentType);
-                pqxx::binarystring binary_content(attachment.content);
-
-                // Execute the prepared statement with parameters
-                pqxx::result fileResult = g_db->execute_prepared(
-                    "file_insert",
-                    escFilename,
-                    escContentType,
-                    binary_content
-                );
-
-                int fileId = g_db->getInsertedId(fileResult);
-
-                // Step 5: Link the email and the file in the junction table
-                std::ostringstream q_link;
-                q_link << "INSERT INTO email_attachments (email_id, file_id) "
-                       << "VALUES (" << emailId << ", " << fileId << ");";
-                g_db->execute(q_link.str());
-            }
-            
-            g_db->commit();
-            send_line(fd, "250 2.0.0 OK: Message accepted");
-
-        } catch (const std::exception& e) {
-            g_db->rollback();
-            std::cerr << "Database transaction failed: " << e.what() << std::endl;
-            send_line(fd, "554 5.7.0 Message rejected due to server error");
-        }
+void send_line(ConnState& st, const std::string& s) {
+    LOG_PROTOCOL("S: " << s);
+    st.outbuf.append(s);
+    st.outbuf.append("\r\n", 2);
+}
 
-        st.dataBuffer.str("");
+// Ends DATA or BDAT LAST: hands the message to the storage threads; the
+// reply is sent by this worker once they acknowledge (see handle_storage_acks)
+static void finish_message(Worker& w, ConnState& st, int fd) {
+    st.inData = false;
+    st.bdat = false;
+    st.binaryMime = false;
+    if (st.oversize || st.longLine) {
+        if (st.parser) st.parser->reset();
         st.dataBuffer.clear();
         st.recipients.clear();
         st.sender.clear();
+        if (st.longLine) {
+            send_line(st, "500 5.5.2 Line too long"); // RFC 5321 section 4.5.3.1.6
+        } else {
+            metrics::add(metrics::kMailRefusedSize);
+            send_line(st, "552 5.3.4 Message size exceeds fixed maximum message size");
+        }
+        st.oversize = st.longLine = false;
+        return;
+    }
+
+    StorageJob job;
+    job.worker = w.id;
+    job.fd = fd;
+    job.connId = st.id;
+    job.sender = std::move(st.sender);
+    job.recipients = std::move(st.recipients);
+    job.raw = std::move(st.dataBuffer);
+    if (st.parser) job.parsed = st.parser->finish(); // parser is kept for the next message
+    // The message leaves the session's buffers but stays in memory until
+    // the storage thread has finished with it; the budget counts it till then
+    job.charged = job.raw.size();
+    int64_t charged = static_cast<int64_t>(job.charged);
+    charge_buffered(w, charged);
+    if (storage_submit(std::move(job))) {
+        st.awaitingStorage = true;
+        w.load.pending.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        charge_buffered(w, -charged);
+        send_line(st, "451 4.3.0 Storage queue full, try again later");
+    }
+
+    st.dataBuffer.clear();
+    st.recipients.clear();
+    st.sender.clear();
+}
+
+// Appends message text (whole lines, CRLF kept) to the buffer and parser.
+// Past max_message_size the message is dropped and the rest only scanned
+// for the terminator.
+static void append_data(ConnState& st, const char* p, size_t n) {
+    if (st.oversize || st.longLine) return;
+    if (static_cast<long long>(st.dataBuffer.size() + n) > g_config.max_message_size) {
+        st.oversize = true;
+        std::string().swap(st.dataBuffer);
+        return;
     }
+    st.dataBuffer.append(p, n);
+    if (st.parser) st.parser->feed(p, n);
+}
 
- else {
-            st.dataBuffer << line << "\n";
+size_t consume_data(Worker& w, ConnState& st, int fd, const char* data, size_t len) {
+    static const char kDotLine[] = {'\n', '.'};
+    const char* p = data;
+    const char* end = data + len;
+    while (p < end) {
+        if (*p == '.') {
+            // Dot-stuffed line, or the terminator
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            if (!nl) break;
+            const char* text = p + 1;
+            p = nl + 1;
+            if (text == nl || (text + 1 == nl && *text == '\r')) {
+                finish_message(w, st, fd);
+                break;
+            }
+            append_data(st, text, p - text);
+            continue;
         }
+        // Copy everything up to the next line that starts with '.', or to the
+        // last complete line in the buffer
+        const char* dot = static_cast<const char*>(memmem(p, end - p, kDotLine, sizeof(kDotLine)));
+        const char* stop;
+        if (dot) {
+            stop = dot + 1;
+        } else {
+            const char* nl = static_cast<const char*>(memrchr(p, '\n', end - p));
+            if (!nl) break;
+            stop = nl + 1;
+        }
+        append_data(st, p, stop - p);
+        p = stop;
+    }
+    return p - data;
+}
+
+// A BDAT chunk has been read in full
+static void end_chunk(Worker& w, ConnState& st, int fd, uint64_t size) {
+    if (st.chunkReply) {
+        send_line(st, st.chunkReply);
+        st.chunkReply = nullptr;
+    } else if (st.chunkLast || st.oversize) {
+        finish_message(w, st, fd);
+    } else {
+        send_line(st, "250 2.0.0 " + std::to_string(size) + " octets received");
+    }
+}
+
+size_t consume_chunk(Worker& w, ConnState& st, int fd, const char* data, size_t len) {
+    size_t n = static_cast<size_t>(std::min<uint64_t>(len, st.chunkRemaining));
+    if (!st.chunkReply) append_data(st, data, n);
+    st.chunkRemaining -= n;
+    if (st.chunkRemaining == 0) end_chunk(w, st, fd, st.chunkSize);
+    return n;
+}
+
+// BDAT <size> [LAST] (RFC 3030). The chunk itself is read by consume_chunk.
+static void start_chunk(Worker& w, ConnState& st, int fd, std::string_view args) {
+    uint64_t size = 0;
+    size_t i = 0;
+    for (; i < args.size() && std::isdigit(static_cast<unsigned char>(args[i])); ++i) {
+        if (size > (1ULL << 50)) break;
+        size = size * 10 + static_cast<uint64_t>(args[i] - '0');
+    }
+    std::string_view rest = args.substr(i);
+    bool last = rest == " LAST" || rest == " last";
+    if (i == 0 || (!rest.empty() && !last)) {
+        // Without a valid size the chunk cannot be skipped; the client has to resync
+        send_line(st, "501 5.5.4 Syntax: BDAT <size> [LAST]");
         return;
     }
 
+    st.chunkRemaining = size;
+    st.chunkLast = last;
+    st.chunkSize = size;
+    // A refused chunk is still read, then answered
+    if (st.sender.empty() || st.recipients.empty()) st.chunkReply = "503 5.5.1 Bad sequence of commands";
+    else if (!st.bdat && memory_over_budget()) {
+        // The refusal fails the transaction: pipelined chunks behind this
+        // one get 503 instead of being stored as a message missing its start
+        metrics::add(metrics::kMailRefusedBudget);
+        st.chunkReply = "452 4.3.1 Insufficient system storage";
+        if (st.parser) st.parser->reset();
+        st.dataBuffer.clear();
+        st.recipients.clear();
+        st.sender.clear();
+        st.binaryMime = false;
+    }
+    else if (!st.bdat) {
+        st.bdat = true;
+        if (!st.parser) st.parser = std::make_unique<mail::StreamParser>();
+    }
+    if (size == 0) end_chunk(w, st, fd, 0);
+}
+
+void process_smtp_line(Worker& w, ConnState& st, int fd, std::string_view line) {
     // Normal SMTP commands
     if (line.rfind("HELO", 0) == 0 || line.rfind("EHLO", 0) == 0) {
         std::string client_name = "unknown";
         size_t space_pos = line.find(' ');
-        if (space_pos != std::string::npos) client_name = line.substr(space_pos + 1);
+        if (space_pos != std::string_view::npos) client_name = std::string(line.substr(space_pos + 1));
 
-        send_line(fd, "250-mx.distyn.com Hello " + client_name);
-        send_line(fd, "250-SIZE 35882577");
-        send_line(fd, "250-8BITMIME");
-        send_line(fd, "250-PIPELINING");
-        send_line(fd, "250 HELP");
+        st.helo = true;
+        send_line(st, "250-mx.distyn.com Hello " + client_name);
+        send_line(st, "250-SIZE " + std::to_string(g_config.max_message_size));
+        send_line(st, "250-8BITMIME");
+        send_line(st, "250-PIPELINING");
+        send_line(st, "250-CHUNKING");
+        send_line(st, "250-BINARYMIME");
+        send_line(st, "250 HELP");
 
     } else if (line.rfind("MAIL FROM:", 0) == 0) {
         std::string sender = extract_sender(line);
         std::string domain = getEmailDomain(sender);
-        if (domain.empty()) { send_line(fd,"501 Incorrect email format"); return; }
-        bool spf_allowed = spf::spf_allows(domain, st.ip);
-        if (!spf_allowed) { send_line(fd,"550 5.7.1 Access denied: invalid sender"); return; }
-        st.sender = sender;
-        send_line(fd,"250 OK");
+        if (domain.empty()) { send_line(st,"501 Incorrect email format"); return; }
+        if (extract_size_param(line) > g_config.max_message_size) {
+            metrics::add(metrics::kMailRefusedSize);
+            send_line(st, "552 5.3.4 Message size exceeds fixed maximum message size");
+            return;
+        }
+        if (memory_over_budget()) {
+            metrics::add(metrics::kMailRefusedBudget);
+            send_line(st, "452 4.3.1 Insufficient system storage");
+            return;
+        }
+        std::string_view body = extract_mail_param(line, "BODY");
+        st.binaryMime = body.size() == 10 && (body == "BINARYMIME" || body == "binarymime");
+        // SPF runs on its own threads; the reply is sent by this worker
+        // once the verdict comes back (see finish_mail_from)
+        SpfJob job;
+        job.worker = w.id;
+        job.fd = fd;
+        job.connId = st.id;
+        job.sender = sender;
+        job.domain = domain;
+        job.ip = st.ip;
+        if (spf_submit(std::move(job))) {
+            st.awaitingSpf = true;
+            w.load.pending.fetch_add(1, std::memory_order_relaxed);
+        } else send_line(st, "451 4.3.0 SPF check queue full, try again later");
 
     } else if (line.rfind("RCPT TO:", 0) == 0) {
-        st.recipients.push_back(line.substr(8));
-        send_line(fd, "250 OK");
+        st.recipients.emplace_back(line.substr(8));
+        send_line(st, "250 OK");
 
     } else if (line == "DATA") {
-        if (st.sender.empty() || st.recipients.empty()) send_line(fd, "503 Bad sequence of commands");
-        else { send_line(fd, "354 End data with <CR><LF>.<CR><LF>"); st.inData = true; }
+        if (st.sender.empty() || st.recipients.empty()) send_line(st, "503 Bad sequence of commands");
+        else if (st.bdat || st.binaryMime) send_line(st, "503 5.5.1 DATA not allowed with BDAT or BODY=BINARYMIME");
+        else if (memory_over_budget()) {
+            metrics::add(metrics::kMailRefusedBudget);
+            send_line(st, "452 4.3.1 Insufficient system storage");
+        }
+        else {
+            send_line(st, "354 End data with <CR><LF>.<CR><LF>");
+            st.inData = true;
+            if (!st.parser) st.parser = std::make_unique<mail::StreamParser>();
+        }
+
+    } else if (line.rfind("BDAT ", 0) == 0) {
+        start_chunk(w, st, fd, line.substr(5));
 
     } else if (line == "RSET") {
-        st.sender.clear(); st.recipients.clear(); st.dataBuffer.str(""); st.dataBuffer.clear(); st.inData = false;
-        send_line(fd, "250 OK");
-
-    } else if (line == "NOOP") send_line(fd, "250 OK");
-    else if (line == "VRFY") send_line(fd, "252 Cannot VRFY user, but will accept message");
-    else if (line == "HELP") { send_line(fd, "214-Commands supported:"); send_line(fd, "214 HELO EHLO MAIL RCPT DATA RSET NOOP QUIT HELP VRFY"); }
-    else if (line == "QUIT") { send_line(fd, "221 Bye"); shutdown(fd, SHUT_RDWR); }
-    else if (!line.empty()) send_line(fd, "502 Command not implemented");
+        if (st.bdat && st.parser) st.parser->reset(); // drop a half-received message
+        st.sender.clear(); st.recipients.clear(); st.dataBuffer.clear(); st.inData = false;
+        st.bdat = st.binaryMime = st.oversize = st.longLine = false;
+        send_line(st, "250 OK");
+
+    } else if (line == "NOOP") send_line(st, "250 OK");
+    else if (line == "VRFY") send_line(st, "252 Cannot VRFY user, but will accept message");
+    else if (line == "HELP") { send_line(st, "214-Commands supported:"); send_line(st, "214 HELO EHLO MAIL RCPT DATA BDAT RSET NOOP QUIT HELP VRFY"); }
+    else if (line == "QUIT") { send_line(st, "221 Bye"); st.closing = true; }
+    else if (!line.empty()) send_line(st, "502 Command not implemented");
+}
+
+void finish_mail_from(ConnState& st, int fd, const SpfVerdict& verdict) {
+    st.awaitingSpf = false;
+    std::string result = spf::result_name(verdict.result);
+    switch (spf_action(verdict.result)) {
+        case SpfAction::Reject:
+            send_line(st, "550 5.7.23 SPF check failed (" + result + ")");
+            return;
+        case SpfAction::TempFail:
+            send_line(st, "451 4.7.24 SPF check could not complete (" + result + "), try again later");
+            return;
+        case SpfAction::Accept:
+            break;
+    }
+    st.sender = verdict.sender;
+    send_line(st,"250 OK");
 }
@@ -1,334 +1,276 @@
 #include "spf_check.h"
-#include <resolv.h>
+#include "spf_policy.h"
+#include "dns_resolver.h"
+#include "ttl_cache.h"
+#include "config.h"
 #include <arpa/inet.h>
-#include <netdb.h>
-#include <cstring>
-#include <iostream>
+#include <strings.h>
 #include <vector>
-#include <sstream>
-#include <regex>
-#include <unordered_set>
-#include <algorithm>
+#include <chrono>
+#include <memory>
 
-// Helper: Check if a string is a valid IP address
-static bool is_valid_ip(const std::string& ip) {
-    struct sockaddr_in sa4;
-    struct sockaddr_in6 sa6;
-    return inet_pton(AF_INET, ip.c_str(), &sa4) == 1 || 
-           inet_pton(AF_INET6, ip.c_str(), &sa6) == 1;
+// DNS answers are kept until their TTL runs out. Empty answers (NXDOMAIN
+// or no records) are cached too, for spf_negative_ttl_secs; transient
+// errors are not cached.
+using spf::DnsAnswer;
+
+template <typename T>
+static std::chrono::seconds cache_ttl(const DnsAnswer<T>& ans) {
+    if (ans.values.empty()) return std::chrono::seconds(g_config.spf_negative_ttl_secs);
+    return std::chrono::seconds(ans.ttl);
 }
 
-// Helper: Extract all TXT records for a domain
-static std::vector<std::string> get_txt_records(const std::string& domain) {
-    std::vector<std::string> records;
-    unsigned char answer[4096];
-    
-    int len = res_query(domain.c_str(), C_IN, ns_t_txt, answer, sizeof(answer));
-    if (len < 0) return records;
+using spf::IpAddr;
+using spf::Mechanism;
+using spf::PolicyPtr;
+using spf::Result;
 
-    ns_msg handle;
-    if (ns_initparse(answer, len, &handle) < 0) return records;
+// Policy lookup outcome: a compiled policy, None (no record), or an error
+struct PolicyLookup {
+    PolicyPtr policy;
+    Result status = Result::None;   // Pass here just means "policy found"
+};
 
-    int count = ns_msg_count(handle, ns_s_an);
-    for (int i = 0; i < count; i++) {
-        ns_rr rr;
-        if (ns_parserr(&handle, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == ns_t_txt) {
-            const unsigned char* rdata = ns_rr_rdata(rr);
-            int rdlen = ns_rr_rdlen(rr);
-            std::string txt;
-            
-            // TXT records can have multiple character strings
-            int pos = 0;
-            while (pos < rdlen) {
-                int segment_len = rdata[pos++];
-                if (pos + segment_len > rdlen) break;
-                txt.append(reinterpret_cast<const char*>(rdata + pos), segment_len);
-                pos += segment_len;
-            }
-            
-            records.push_back(txt);
-        }
-    }
-    
-    return records;
+static TtlCache<PolicyLookup>& policy_cache() {
+    static TtlCache<PolicyLookup> cache(g_config.spf_cache_size);
+    return cache;
 }
 
-// Helper: Get SPF record from TXT records
-static std::string get_spf_record(const std::string& domain) {
-    auto records = get_txt_records(domain);
-    for (const auto& record : records) {
-        if (record.find("v=spf1") == 0) {
-            return record;
-        }
-    }
-    return "";
+// "v=spf1" followed by a space or nothing, any case (RFC 7208 4.5)
+static bool is_spf_record(const std::string& txt) {
+    if (txt.size() < 6 || strncasecmp(txt.c_str(), "v=spf1", 6) != 0) return false;
+    return txt.size() == 6 || txt[6] == ' ';
 }
 
-// Helper: Check if IP matches CIDR range
-static bool match_cidr(const std::string& ip, const std::string& cidr) {
-    size_t slash_pos = cidr.find('/');
-    std::string network = cidr.substr(0, slash_pos);
-    int prefix_len = 32; // Default for IPv4
-    
-    if (slash_pos != std::string::npos) {
-        prefix_len = std::stoi(cidr.substr(slash_pos + 1));
+// Helper: Get the compiled SPF policy of a domain. Records are compiled
+// once and shared until their TTL runs out.
+static PolicyLookup get_spf_policy(const std::string& domain) {
+    PolicyLookup lookup;
+    if (policy_cache().get(domain, lookup)) return lookup;
+
+    DnsAnswer<std::string> ans = spf::resolver().txt(domain);
+    if (ans.temp_error) {
+        lookup.status = Result::TempError;
+        return lookup;
     }
-    
-    // Check if IP is IPv4 or IPv6
-    if (ip.find(':') != std::string::npos) {
-        // IPv6
-        struct in6_addr ip_addr, network_addr;
-        if (inet_pton(AF_INET6, ip.c_str(), &ip_addr) != 1 ||
-            inet_pton(AF_INET6, network.c_str(), &network_addr) != 1) {
-            return false;
-        }
-        
-        // Compare the network portion
-        int bytes = prefix_len / 8;
-        int bits = prefix_len % 8;
-        
-        for (int i = 0; i < bytes; i++) {
-            if (ip_addr.s6_addr[i] != network_addr.s6_addr[i]) {
-                return false;
-            }
-        }
-        
-        if (bits > 0) {
-            uint8_t mask = 0xFF << (8 - bits);
-            if ((ip_addr.s6_addr[bytes] & mask) != (network_addr.s6_addr[bytes] & mask)) {
-                return false;
-            }
-        }
-        
-        return true;
-    } else {
-        // IPv4
-        struct in_addr ip_addr, network_addr;
-        if (inet_pton(AF_INET, ip.c_str(), &ip_addr) != 1 ||
-            inet_pton(AF_INET, network.c_str(), &network_addr) != 1) {
-            return false;
-        }
-        
-        uint32_t mask = prefix_len == 0 ? 0 : htonl(~((1 << (32 - prefix_len)) - 1));
-        return (ip_addr.s_addr & mask) == (network_addr.s_addr & mask);
+    int found = 0;
+    for (const auto& record : ans.values) {
+        if (!is_spf_record(record)) continue;
+        if (++found == 1) lookup.policy = spf::compile_policy(record);
+    }
+    if (found > 1) {
+        lookup.policy.reset();
+        lookup.status = Result::PermError;   // more than one SPF record
+    } else if (found == 1) {
+        lookup.status = Result::Pass;
     }
+    // A domain without a record is cached negatively, like a failed lookup
+    policy_cache().put(domain, lookup, found ? std::chrono::seconds(ans.ttl)
+                                             : std::chrono::seconds(g_config.spf_negative_ttl_secs));
+    return lookup;
 }
 
-// Helper: Resolve domain to IP addresses
-static std::vector<std::string> resolve_domain(const std::string& domain) {
-    std::vector<std::string> ips;
-    struct addrinfo hints, *res, *p;
-    
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM;
-    
-    if (getaddrinfo(domain.c_str(), NULL, &hints, &res) != 0) {
-        return ips;
-    }
-    
-    for (p = res; p != NULL; p = p->ai_next) {
-        char ipstr[INET6_ADDRSTRLEN];
-        void *addr;
-        
-        if (p->ai_family == AF_INET) {
-            struct sockaddr_in *ipv4 = (struct sockaddr_in *)p->ai_addr;
-            addr = &(ipv4->sin_addr);
-        } else {
-            struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)p->ai_addr;
-            addr = &(ipv6->sin6_addr);
-        }
-        
-        inet_ntop(p->ai_family, addr, ipstr, sizeof ipstr);
-        ips.push_back(ipstr);
-    }
-    
-    freeaddrinfo(res);
-    return ips;
+static TtlCache<DnsAnswer<IpAddr>>& addr_cache() {
+    static TtlCache<DnsAnswer<IpAddr>> cache(g_config.spf_cache_size);
+    return cache;
+}
+
+static TtlCache<DnsAnswer<std::string>>& mx_cache() {
+    static TtlCache<DnsAnswer<std::string>> cache(g_config.spf_cache_size);
+    return cache;
+}
+
+// Helper: Resolve domain to IP addresses (A and AAAA), kept in binary for
+// prefix comparisons
+static DnsAnswer<IpAddr> resolve_domain(const std::string& domain) {
+    DnsAnswer<IpAddr> ans;
+    if (addr_cache().get(domain, ans)) return ans;
+
+    ans = spf::resolver().addresses(domain);
+    if (!ans.temp_error) addr_cache().put(domain, ans, cache_ttl(ans));
+    return ans;
 }
 
 // Helper: Get MX records for a domain
-static std::vector<std::string> get_mx_records(const std::string& domain) {
-    std::vector<std::string> mx_hosts;
-    unsigned char answer[4096];
-    
-    int len = res_query(domain.c_str(), C_IN, ns_t_mx, answer, sizeof(answer));
-    if (len < 0) return mx_hosts;
-    
-    ns_msg handle;
-    if (ns_initparse(answer, len, &handle) < 0) return mx_hosts;
-    
-    int count = ns_msg_count(handle, ns_s_an);
-    for (int i = 0; i < count; i++) {
-        ns_rr rr;
-        if (ns_parserr(&handle, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == ns_t_mx) {
-            char mxname[NS_MAXDNAME];
-            const unsigned char* rdata = ns_rr_rdata(rr);
-            // Skip preference value (2 bytes)
-            dn_expand(ns_msg_base(handle), ns_msg_end(handle), rdata + 2, mxname, sizeof(mxname));
-            mx_hosts.push_back(mxname);
-        }
-    }
-    
-    return mx_hosts;
+static DnsAnswer<std::string> get_mx_records(const std::string& domain) {
+    DnsAnswer<std::string> ans;
+    if (mx_cache().get(domain, ans)) return ans;
+
+    ans = spf::resolver().mx(domain);
+    if (!ans.temp_error) mx_cache().put(domain, ans, cache_ttl(ans));
+    return ans;
 }
 
-// Helper: Parse mechanism and qualifier
-static void parse_mechanism(const std::string& token, char& qualifier, std::string& mechanism) {
-    if (token.empty()) {
-        qualifier = '+';
-        mechanism = "";
-        return;
+// --- evaluation -------------------------------------------------------------
+// RFC 7208 4.6.4: at most 10 terms that query DNS per check_host() run,
+// including nested includes and redirects, and at most 2 of their lookups
+// may come back empty. Cached answers count too; the limits bound the work
+// a record can cause, not just our traffic.
+static const int kMaxDnsTerms = 10;
+static const int kMaxVoidLookups = 2;
+static const size_t kMaxMxHosts = 10;
+
+struct EvalContext {
+    IpAddr ip;
+    int dns_terms = 0;
+    int void_lookups = 0;
+
+    // Counts a DNS-querying term; false once over the limit
+    bool charge() { return ++dns_terms <= kMaxDnsTerms; }
+    // Counts an empty answer; false once over the limit
+    template <typename T>
+    bool note_void(const DnsAnswer<T>& ans) {
+        return !ans.values.empty() || ++void_lookups <= kMaxVoidLookups;
     }
-    
-    // Check for qualifier
-    if (token[0] == '+' || token[0] == '-' || token[0] == '~' || token[0] == '?') {
-        qualifier = token[0];
-        mechanism = token.substr(1);
+};
+
+// Sentinel for "no error, keep going"
+static const Result kContinue = Result::None;
+
+// Helper: Does any address of `domain` share the client's network?
+// Returns kContinue with `matched` set, or an error result.
+static Result match_addresses(EvalContext& ctx, const std::string& domain, const spf::Term& term, bool& matched) {
+    DnsAnswer<IpAddr> ans = resolve_domain(domain);
+    if (ans.temp_error) return Result::TempError;
+    if (!ctx.note_void(ans)) return Result::PermError;
+    for (const auto& addr : ans.values) {
+        if (spf::same_network(ctx.ip, addr, term.cidr4, term.cidr6)) { matched = true; break; }
+    }
+    return kContinue;
+}
+
+// Helper: Match an ip4:/ip6: table against the client address
+static bool match_table(const spf::Term& term, const IpAddr& ip) {
+    if (ip.family == AF_INET) {
+        uint32_t addr = ip.v4();
+        for (const auto& net : term.v4) {
+            if (net.contains(addr)) return true;
+        }
     } else {
-        qualifier = '+'; // Default qualifier is pass
-        mechanism = token;
+        for (const auto& net : term.v6) {
+            if (net.contains(ip.bytes)) return true;
+        }
     }
+    return false;
 }
 
-// Recursive SPF check with depth limiting and cycle detection
-static bool eval_spf(const std::string& domain, const std::string& ip, 
-                    int depth, std::unordered_set<std::string>& visited) {
-    if (depth > 10) return false; // Avoid infinite recursion
-    if (visited.find(domain) != visited.end()) return false; // Avoid cycles
-    visited.insert(domain);
-    
-    std::string spf_record = get_spf_record(domain);
-    if (spf_record.empty()) return false;
-    
-    // Check for redirect modifier first
-    std::smatch match;
-    if (std::regex_search(spf_record, match, std::regex("redirect=([^\\s]+)"))) {
-        std::string redirect_domain = match[1].str();
-        return eval_spf(redirect_domain, ip, depth + 1, visited);
+static Result qualifier_result(char qualifier) {
+    switch (qualifier) {
+        case '-': return Result::Fail;
+        case '~': return Result::SoftFail;
+        case '?': return Result::Neutral;
+        default:  return Result::Pass;
     }
+}
+
+// RFC 7208 check_host() for one domain; recursion handles include/redirect
+static Result eval_spf(EvalContext& ctx, const std::string& domain) {
+    PolicyLookup lookup = get_spf_policy(domain);
+    if (!lookup.policy) return lookup.status;   // None, TempError or PermError
+    const spf::Policy& policy = *lookup.policy;
+    if (policy.malformed) return Result::PermError;
     
-    std::istringstream iss(spf_record);
-    std::string token;
-    
-    // Skip version part
-    iss >> token; // v=spf1
-    
-    bool has_all = false;
-    char all_qualifier = '+';
-    
-    while (iss >> token) {
-        // Skip modifiers (other than redirect which we handled above)
-        if (token.find("=") != std::string::npos) {
-            continue;
-        }
-        
-        char qualifier;
-        std::string mechanism;
-        parse_mechanism(token, qualifier, mechanism);
-        
-        if (mechanism == "all") {
-            has_all = true;
-            all_qualifier = qualifier;
-            continue; // Evaluate all at the end
-        }
-        
+    for (const spf::Term& term : policy.terms) {
+        const std::string& target = term.domain.empty() ? domain : term.domain;
         bool match_found = false;
+        Result err = kContinue;
         
-        if (mechanism.find("ip4:") == 0) {
-            std::string cidr = mechanism.substr(4);
-            match_found = match_cidr(ip, cidr);
-        } else if (mechanism.find("ip6:") == 0) {
-            std::string cidr = mechanism.substr(4);
-            match_found = match_cidr(ip, cidr);
-        } else if (mechanism.find("a:") == 0) {
-            std::string target_domain = mechanism.substr(2);
-            size_t slash_pos = target_domain.find('/');
-            if (slash_pos != std::string::npos) {
-                target_domain = target_domain.substr(0, slash_pos);
-            }
-            
-            auto ips = resolve_domain(target_domain);
-            for (const auto& resolved_ip : ips) {
-                if (resolved_ip == ip) {
-                    match_found = true;
-                    break;
+        switch (term.mech) {
+            case Mechanism::All:
+                match_found = true;
+                break;
+            case Mechanism::IpTable:
+                match_found = match_table(term, ctx.ip);
+                break;
+            case Mechanism::A:
+                if (!ctx.charge()) return Result::PermError;
+                err = match_addresses(ctx, target, term, match_found);
+                break;
+            case Mechanism::Mx: {
+                if (!ctx.charge()) return Result::PermError;
+                DnsAnswer<std::string> mx = get_mx_records(target);
+                if (mx.temp_error) return Result::TempError;
+                if (!ctx.note_void(mx)) return Result::PermError;
+                if (mx.values.size() > kMaxMxHosts) return Result::PermError;
+                for (const auto& host : mx.values) {
+                    err = match_addresses(ctx, host, term, match_found);
+                    if (err != kContinue || match_found) break;
                 }
+                break;
             }
-        } else if (mechanism == "a") {
-            auto ips = resolve_domain(domain);
-            for (const auto& resolved_ip : ips) {
-                if (resolved_ip == ip) {
-                    match_found = true;
-                    break;
-                }
+            case Mechanism::Include: {
+                if (!ctx.charge()) return Result::PermError;
+                // Only an inner Pass counts as a match (RFC 7208 5.2)
+                Result inner = eval_spf(ctx, target);
+                if (inner == Result::TempError) return Result::TempError;
+                if (inner == Result::PermError || inner == Result::None) return Result::PermError;
+                match_found = inner == Result::Pass;
+                break;
             }
-        } else if (mechanism.find("mx:") == 0) {
-            std::string target_domain = mechanism.substr(3);
-            auto mx_hosts = get_mx_records(target_domain);
-            for (const auto& host : mx_hosts) {
-                auto ips = resolve_domain(host);
-                for (const auto& resolved_ip : ips) {
-                    if (resolved_ip == ip) {
-                        match_found = true;
-                        break;
-                    }
-                }
-                if (match_found) break;
-            }
-        } else if (mechanism == "mx") {
-            auto mx_hosts = get_mx_records(domain);
-            for (const auto& host : mx_hosts) {
-                auto ips = resolve_domain(host);
-                for (const auto& resolved_ip : ips) {
-                    if (resolved_ip == ip) {
-                        match_found = true;
-                        break;
-                    }
-                }
-                if (match_found) break;
-            }
-        } else if (mechanism.find("include:") == 0) {
-            std::string include_domain = mechanism.substr(8);
-            match_found = eval_spf(include_domain, ip, depth + 1, visited);
-        } else if (mechanism.find("exists:") == 0) {
-            std::string test_domain = mechanism.substr(7);
-            // For exists, we just check if the domain resolves
-            match_found = !resolve_domain(test_domain).empty();
-        }
-        // Note: ptr mechanism is not recommended and often disabled
-        
-        if (match_found) {
-            // Apply qualifier
-            switch (qualifier) {
-                case '+': return true;  // Pass
-                case '-': return false; // Fail
-                case '~': return false; // Softfail (treated as false for strict checking)
-                case '?': return false; // Neutral (treated as false)
+            case Mechanism::Exists: {
+                if (!ctx.charge()) return Result::PermError;
+                DnsAnswer<IpAddr> ans = resolve_domain(target);
+                if (ans.temp_error) return Result::TempError;
+                if (!ctx.note_void(ans)) return Result::PermError;
+                match_found = !ans.values.empty();
+                break;
             }
+            case Mechanism::Ptr:
+                // Deprecated (RFC 7208 5.5); counted but never matched
+                if (!ctx.charge()) return Result::PermError;
+                break;
         }
+        if (err != kContinue) return err;
+        if (match_found) return qualifier_result(term.qualifier);
     }
     
-    // If we get here, no mechanism matched, so use the all mechanism if present
-    if (has_all) {
-        switch (all_qualifier) {
-            case '+': return true;  // Pass
-            case '-': return false; // Fail
-            case '~': return false; // Softfail
-            case '?': return false; // Neutral
-        }
+    // No mechanism matched: follow redirect=, otherwise Neutral
+    if (!policy.redirect.empty()) {
+        if (!ctx.charge()) return Result::PermError;
+        Result r = eval_spf(ctx, policy.redirect);
+        return r == Result::None ? Result::PermError : r;
     }
-    
-    return false; // Default to fail if no mechanism matches and no all mechanism
+    return Result::Neutral;
+}
+
+// A domain check_host() can evaluate: non-empty labels, at least one dot
+static bool usable_domain(const std::string& domain) {
+    if (domain.empty() || domain.size() > 253 || domain.find('.') == std::string::npos) return false;
+    if (domain.front() == '.' || domain.find("..") != std::string::npos) return false;
+    return true;
 }
 
 namespace spf {
-    bool spf_allows(const std::string& domain, const std::string& ip) {
-        if (!is_valid_ip(ip)) {
-            return false;
+    const char* result_name(Result r) {
+        switch (r) {
+            case Result::None:      return "none";
+            case Result::Neutral:   return "neutral";
+            case Result::Pass:      return "pass";
+            case Result::Fail:      return "fail";
+            case Result::SoftFail:  return "softfail";
+            case Result::TempError: return "temperror";
+            case Result::PermError: return "permerror";
         }
-        
-        std::unordered_set<std::string> visited;
-        return eval_spf(domain, ip, 0, visited);
+        return "unknown";
+    }
+
+    CacheStats cache_stats() {
+        CacheStats stats;
+        stats.policy_hits = policy_cache().hits();
+        stats.policy_misses = policy_cache().misses();
+        stats.address_hits = addr_cache().hits();
+        stats.address_misses = addr_cache().misses();
+        stats.mx_hits = mx_cache().hits();
+        stats.mx_misses = mx_cache().misses();
+        return stats;
     }
-}
\ No newline at end of file
+
+    Result check_host(const std::string& domain, const std::string& ip) {
+        // The client address is parsed once; everything after is binary
+        EvalContext ctx;
+        if (!ctx.ip.parse(ip) || !usable_domain(domain)) {
+            return Result::None;
+        }
+        return eval_spf(ctx, domain);
+    }
+}
@@ -0,0 +1,82 @@
+#include "spf_engine.h"
+#include "logger.h"
+#include "spf_check.h"
+#include "config.h"
+#include "metrics.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <sched.h>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+// SPF evaluation does blocking DNS lookups, so it runs here rather than on
+// the epoll workers: a slow name server only delays the sessions waiting
+// on it. Record and answer caching lives in spf_check.cpp.
+
+static std::unique_ptr<BoundedQueue<SpfJob>> g_spf_jobs;
+static int g_spf_efd = -1;               // blocking semaphore eventfd: one count per queued job
+static std::vector<Worker>* g_spf_workers = nullptr;
+
+static void deliver_verdict(const SpfJob& job, spf::Result result) {
+    Worker& w = (*g_spf_workers)[job.worker];
+    SpfVerdict v{job.fd, job.connId, job.sender, result};
+    // Sized for every job that can be in flight, as with storage acks
+    while (!w.spfVerdicts->try_push(std::move(v))) sched_yield();
+    uint64_t one = 1;
+    ssize_t n = write(w.evfd, &one, sizeof(one));
+    (void)n;
+}
+
+static void spf_loop() {
+    while (true) {
+        uint64_t token;
+        ssize_t n = read(g_spf_efd, &token, sizeof(token));
+        if (n < 0 && errno == EINTR) continue;
+        if (n != sizeof(token)) { LOG_ERRNO("spf read"); return; }
+
+        SpfJob job;
+        while (!g_spf_jobs->try_pop(job)) sched_yield();
+        spf::Result result;
+        {
+            metrics::Timer timer(metrics::kSpfCheck);
+            result = spf::check_host(job.domain, job.ip);
+        }
+        metrics::add(static_cast<metrics::Counter>(metrics::kSpfNone + static_cast<int>(result)));
+        deliver_verdict(job, result);
+    }
+}
+
+SpfAction spf_action(spf::Result result) {
+    switch (result) {
+        case spf::Result::Pass:      return SpfAction::Accept;
+        case spf::Result::None:      return g_config.spf_on_none;
+        case spf::Result::Neutral:   return g_config.spf_on_neutral;
+        case spf::Result::SoftFail:  return g_config.spf_on_softfail;
+        case spf::Result::Fail:      return g_config.spf_on_fail;
+        case spf::Result::TempError: return g_config.spf_on_temperror;
+        case spf::Result::PermError: return g_config.spf_on_permerror;
+    }
+    return SpfAction::Reject;
+}
+
+void spf_start(std::vector<Worker>& workers) {
+    g_spf_workers = &workers;
+    g_spf_jobs = std::make_unique<BoundedQueue<SpfJob>>(g_config.spf_queue_size);
+    g_spf_efd = eventfd(0, EFD_SEMAPHORE);
+    if (g_spf_efd < 0) { LOG_ERRNO("eventfd"); return; }
+
+    int threads = g_config.spf_threads > 0 ? g_config.spf_threads : 1;
+    for (int i = 0; i < threads; ++i) {
+        std::thread(spf_loop).detach();
+    }
+}
+
+bool spf_submit(SpfJob&& job) {
+    if (g_spf_efd < 0 || !g_spf_jobs->try_push(std::move(job))) return false;
+    uint64_t one = 1;
+    ssize_t n = write(g_spf_efd, &one, sizeof(one));
+    (void)n;
+    return true;
+}
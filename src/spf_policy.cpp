@@ -0,0 +1,191 @@
+#include "spf_policy.h"
+#include <arpa/inet.h>
+#include <cctype>
+#include <cstring>
+
+namespace spf {
+
+bool IpAddr::parse(const std::string& text) {
+    if (inet_pton(AF_INET, text.c_str(), bytes) == 1) { family = AF_INET; return true; }
+    if (inet_pton(AF_INET6, text.c_str(), bytes) == 1) { family = AF_INET6; return true; }
+    family = 0;
+    return false;
+}
+
+uint32_t IpAddr::v4() const {
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+}
+
+// Compares the first `prefix` bits of two byte strings
+static bool prefix_equal(const uint8_t* a, const uint8_t* b, int prefix) {
+    int whole = prefix / 8;
+    int bits = prefix % 8;
+    if (std::memcmp(a, b, whole) != 0) return false;
+    if (bits == 0) return true;
+    uint8_t mask = uint8_t(0xFF << (8 - bits));
+    return (a[whole] & mask) == (b[whole] & mask);
+}
+
+bool Net6::contains(const uint8_t* addr) const {
+    return prefix_equal(addr, net, prefix);
+}
+
+bool same_network(const IpAddr& addr, const IpAddr& base, int cidr4, int cidr6) {
+    if (addr.family != base.family) return false;
+    return prefix_equal(addr.bytes, base.bytes, addr.family == AF_INET ? cidr4 : cidr6);
+}
+
+// --- compiler ---------------------------------------------------------------
+// Parses a decimal prefix length in [0, max]; -1 if malformed
+static int parse_prefix(const std::string& s, int max) {
+    if (s.empty() || s.size() > 3) return -1;
+    int v = 0;
+    for (char c : s) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) return -1;
+        v = v * 10 + (c - '0');
+    }
+    return v <= max ? v : -1;
+}
+
+static bool compile_net4(const std::string& arg, Net4& out) {
+    size_t slash = arg.find('/');
+    int prefix = slash == std::string::npos ? 32 : parse_prefix(arg.substr(slash + 1), 32);
+    IpAddr addr;
+    if (prefix < 0 || inet_pton(AF_INET, arg.substr(0, slash).c_str(), addr.bytes) != 1) return false;
+    out.mask = prefix == 0 ? 0 : ~uint32_t(0) << (32 - prefix);
+    out.net = addr.v4() & out.mask;
+    return true;
+}
+
+static bool compile_net6(const std::string& arg, Net6& out) {
+    size_t slash = arg.find('/');
+    int prefix = slash == std::string::npos ? 128 : parse_prefix(arg.substr(slash + 1), 128);
+    if (prefix < 0 || inet_pton(AF_INET6, arg.substr(0, slash).c_str(), out.net) != 1) return false;
+    out.prefix = prefix;
+    // Mask the host bits once so contains() never has to
+    for (int i = 0; i < 16; ++i) {
+        int keep = prefix - i * 8;
+        if (keep >= 8) continue;
+        out.net[i] &= keep <= 0 ? 0 : uint8_t(0xFF << (8 - keep));
+    }
+    return true;
+}
+
+// Splits "[:domain][/cidr4][//cidr6]" for a and mx; false if malformed
+static bool parse_domain_spec(const std::string& rest, Term& t) {
+    size_t slash = rest.find('/');
+    std::string spec = rest.substr(0, slash);
+    if (!spec.empty()) {
+        if (spec[0] != ':' || spec.size() < 2) return false;
+        t.domain = spec.substr(1);
+    }
+    if (slash == std::string::npos) return true;
+
+    std::string cidrs = rest.substr(slash);     // "/24", "//64" or "/24//64"
+    size_t dbl = cidrs.find("//");
+    std::string c4 = dbl == std::string::npos ? cidrs.substr(1) : cidrs.substr(1, dbl == 0 ? 0 : dbl - 1);
+    if (!c4.empty()) {
+        t.cidr4 = parse_prefix(c4, 32);
+        if (t.cidr4 < 0) return false;
+    }
+    if (dbl != std::string::npos) {
+        t.cidr6 = parse_prefix(cidrs.substr(dbl + 2), 128);
+        if (t.cidr6 < 0) return false;
+    }
+    return true;
+}
+
+static std::string lower(std::string s) {
+    for (char& c : s) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+
+PolicyPtr compile_policy(const std::string& record) {
+    auto policy = std::make_shared<Policy>();
+
+    size_t pos = 0;
+    bool first = true;
+    while (pos < record.size()) {
+        size_t start = record.find_first_not_of(" \t", pos);
+        if (start == std::string::npos) break;
+        size_t end = record.find_first_of(" \t", start);
+        if (end == std::string::npos) end = record.size();
+        std::string token = record.substr(start, end - start);
+        pos = end;
+
+        if (first) { first = false; continue; } // v=spf1
+
+        // Modifiers: only redirect= is used; unknown ones are ignored
+        size_t eq = token.find('=');
+        if (eq != std::string::npos) {
+            if (lower(token.substr(0, eq)) == "redirect") {
+                if (!policy->redirect.empty() || eq + 1 == token.size()) policy->malformed = true;
+                policy->redirect = token.substr(eq + 1);
+            }
+            continue;
+        }
+
+        char qualifier = '+';
+        if (token[0] == '+' || token[0] == '-' || token[0] == '~' || token[0] == '?') {
+            qualifier = token[0];
+            token.erase(0, 1);
+        }
+        size_t nameEnd = token.find_first_of(":/");
+        std::string name = lower(token.substr(0, nameEnd));
+        std::string rest = nameEnd == std::string::npos ? std::string() : token.substr(nameEnd);
+
+        if (name == "ip4" || name == "ip6") {
+            if (rest.size() < 2 || rest[0] != ':') { policy->malformed = true; continue; }
+            // Consecutive ip4/ip6 terms with one qualifier share a table
+            if (policy->terms.empty() || policy->terms.back().mech != Mechanism::IpTable ||
+                policy->terms.back().qualifier != qualifier) {
+                Term t;
+                t.mech = Mechanism::IpTable;
+                t.qualifier = qualifier;
+                policy->terms.push_back(std::move(t));
+            }
+            Term& table = policy->terms.back();
+            bool ok;
+            if (name == "ip4") {
+                Net4 n;
+                ok = compile_net4(rest.substr(1), n);
+                if (ok) table.v4.push_back(n);
+            } else {
+                Net6 n;
+                ok = compile_net6(rest.substr(1), n);
+                if (ok) table.v6.push_back(n);
+            }
+            if (!ok) policy->malformed = true;
+            if (table.v4.empty() && table.v6.empty()) policy->terms.pop_back();
+            continue;
+        }
+
+        Term t;
+        t.qualifier = qualifier;
+        bool ok = true;
+        if (name == "all") {
+            t.mech = Mechanism::All;
+            ok = rest.empty();
+        } else if (name == "a" || name == "mx") {
+            t.mech = name == "a" ? Mechanism::A : Mechanism::Mx;
+            ok = parse_domain_spec(rest, t);
+        } else if (name == "include" || name == "exists") {
+            t.mech = name == "include" ? Mechanism::Include : Mechanism::Exists;
+            ok = rest.size() > 1 && rest[0] == ':';
+            if (ok) t.domain = rest.substr(1);
+        } else if (name == "ptr") {
+            t.mech = Mechanism::Ptr;
+            if (!rest.empty()) {
+                ok = rest.size() > 1 && rest[0] == ':';
+                if (ok) t.domain = rest.substr(1);
+            }
+        } else {
+            ok = false; // unknown mechanism
+        }
+        if (!ok) { policy->malformed = true; continue; }
+        policy->terms.push_back(std::move(t));
+    }
+    return policy;
+}
+
+} // namespace spf
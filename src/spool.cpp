@@ -0,0 +1,458 @@
+#include "spool.h"
+#include "logger.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+Spool* g_spool = nullptr;
+
+// --- on-disk format ---------------------------------------------------------
+// Each record: magic(4) type(1) id(8) length(4) crc32(4) payload(length)
+// Message payload: u32 senderLen, sender, u32 rcptCount, (u32 len, rcpt)*, raw
+static const uint32_t kMagic = 0x50535850; // "PXSP"
+static const uint8_t kTypeMessage = 1;
+static const uint8_t kTypeDone = 2;
+static const size_t kHeaderSize = 4 + 1 + 8 + 4 + 4;
+
+static uint32_t crc32(const char* data, size_t len) {
+    static uint32_t table[256];
+    static bool init = [] {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)init;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) c = table[(c ^ (unsigned char)data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+static void put(std::string& out, T v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static bool get(const std::string& in, size_t& pos, T& v) {
+    if (pos + sizeof(v) > in.size()) return false;
+    std::memcpy(&v, in.data() + pos, sizeof(v));
+    pos += sizeof(v);
+    return true;
+}
+
+static std::string encodeMessage(const std::string& sender, const std::vector<std::string>& recipients,
+                                 const std::string& raw) {
+    std::string out;
+    size_t total = 8 + sender.size() + raw.size();
+    for (const auto& r : recipients) total += 4 + r.size();
+    out.reserve(total);
+    put<uint32_t>(out, sender.size());
+    out += sender;
+    put<uint32_t>(out, recipients.size());
+    for (const auto& r : recipients) {
+        put<uint32_t>(out, r.size());
+        out += r;
+    }
+    out += raw;
+    return out;
+}
+
+static bool decodeMessage(const std::string& in, SpoolRecord& out) {
+    size_t pos = 0;
+    uint32_t len = 0, count = 0;
+    if (!get(in, pos, len) || pos + len > in.size()) return false;
+    out.sender.assign(in, pos, len);
+    pos += len;
+    if (!get(in, pos, count)) return false;
+    out.recipients.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!get(in, pos, len) || pos + len > in.size()) return false;
+        out.recipients.emplace_back(in, pos, len);
+        pos += len;
+    }
+    out.raw.assign(in, pos, std::string::npos);
+    return true;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_exact(int fd, char* data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// --- segments ---------------------------------------------------------------
+struct Spool::Segment {
+    uint64_t no = 0;
+    int fd = -1;
+    uint64_t size = 0;
+    ~Segment() { if (fd >= 0) close(fd); }
+};
+
+Spool::Spool(const std::string& dir, size_t segmentBytes, int fsyncIntervalMs)
+    : dir(dir), segmentBytes(segmentBytes), fsyncIntervalMs(fsyncIntervalMs) {}
+
+Spool::~Spool() {
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        stopping = true;
+    }
+    flushCv.notify_all();
+    durableCv.notify_all();
+    if (flusher.joinable()) flusher.join();
+}
+
+std::string Spool::segmentPath(uint64_t seg) const {
+    char name[48];
+    snprintf(name, sizeof(name), "/seg-%020llu.spool", (unsigned long long)seg);
+    return dir + name;
+}
+
+bool Spool::open() {
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        LOG_ERRNO("spool mkdir");
+        return false;
+    }
+
+    if (mkdir((dir + "/dead").c_str(), 0700) < 0 && errno != EEXIST) {
+        LOG_ERRNO("spool mkdir");
+        return false;
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) { LOG_ERRNO("spool opendir"); return false; }
+    std::vector<uint64_t> segs;
+    while (dirent* e = readdir(d)) {
+        unsigned long long no;
+        char tail[8];
+        if (sscanf(e->d_name, "seg-%20llu.%7s", &no, tail) == 2 && strcmp(tail, "spool") == 0) {
+            segs.push_back(no);
+        }
+    }
+    closedir(d);
+    std::sort(segs.begin(), segs.end());
+
+    for (uint64_t seg : segs) recoverSegment(seg);
+
+    // Never append after a possibly torn tail: always start a fresh segment
+    uint64_t next = segs.empty() ? 1 : segs.back() + 1;
+    if (!openSegment(next)) return false;
+    retireSegments();
+
+    if (!entries.empty()) {
+        LOG_INFO("Spool: recovered " << entries.size() << " undelivered message(s).");
+    }
+    flusher = std::thread(&Spool::flushLoop, this);
+    return true;
+}
+
+bool Spool::recoverSegment(uint64_t seg) {
+    std::string path = segmentPath(seg);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { LOG_ERRNO("spool open segment"); return false; }
+    liveBySegment.emplace(seg, 0);
+
+    off_t offset = 0;
+    char hdr[kHeaderSize];
+    std::string payload;
+    while (read_exact(fd, hdr, kHeaderSize, offset)) {
+        uint32_t magic, length, crc;
+        uint8_t type;
+        uint64_t id;
+        std::memcpy(&magic, hdr, 4);
+        std::memcpy(&type, hdr + 4, 1);
+        std::memcpy(&id, hdr + 5, 8);
+        std::memcpy(&length, hdr + 13, 4);
+        std::memcpy(&crc, hdr + 17, 4);
+        if (magic != kMagic) break;
+        payload.resize(length);
+        if (length > 0 && !read_exact(fd, &payload[0], length, offset + kHeaderSize)) break;
+        if (crc32(payload.data(), payload.size()) != crc) break; // torn write
+
+        if (type == kTypeMessage) {
+            entries[id] = Entry{seg, static_cast<uint64_t>(offset), length, false, 0, false};
+            liveBySegment[seg]++;
+        } else if (type == kTypeDone) {
+            auto it = entries.find(id);
+            if (it != entries.end()) {
+                liveBySegment[it->second.segment]--;
+                entries.erase(it);
+            }
+        }
+        nextId = std::max(nextId, id + 1);
+        offset += kHeaderSize + length;
+    }
+    close(fd);
+    return true;
+}
+
+bool Spool::openSegment(uint64_t seg) {
+    std::string path = segmentPath(seg);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) { LOG_ERRNO("spool create segment"); return false; }
+    // Make the new directory entry itself durable
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+
+    auto s = std::make_shared<Segment>();
+    s->no = seg;
+    s->fd = fd;
+    active = s;
+    liveBySegment.emplace(seg, 0);
+    return true;
+}
+
+// Caller holds mtx. Syncs the active segment and moves on to the next one.
+// A segment whose sync already failed is not synced again: a retry can
+// report success for pages the kernel has dropped. Its successor is synced
+// before anything is written to it.
+bool Spool::rotate() {
+    std::shared_ptr<Segment> old = active;
+    if (!failed) {
+        if (fdatasync(old->fd) < 0) {
+            LOG_ERRNO("spool fdatasync");
+            syncFailed(old->no);
+        } else {
+            durableSeq = writtenSeq;
+            durableCv.notify_all();
+        }
+    }
+    if (!openSegment(old->no + 1)) { active = old; return false; }
+    if (failed && fdatasync(active->fd) < 0) {
+        LOG_ERRNO("spool fdatasync");
+        active = old;
+        return false;
+    }
+    failed = false;
+    return true;
+}
+
+// Caller holds mtx. Records in `seg` that no completed sync covers may be
+// gone: their writers are told so, and the segment takes no more appends.
+void Spool::syncFailed(uint64_t seg) {
+    for (auto& kv : entries) {
+        Entry& e = kv.second;
+        if (e.segment == seg && e.seq > durableSeq) e.lost = true;
+    }
+    if (active && active->no == seg) failed = true;
+    durableCv.notify_all();
+}
+
+// Caller holds mtx
+bool Spool::writeRecord(uint8_t type, uint64_t id, const std::string& payload, uint64_t& offset) {
+    if (failed || active->size >= segmentBytes) {
+        if (!rotate()) return false;
+    }
+
+    std::string hdr;
+    hdr.reserve(kHeaderSize);
+    put<uint32_t>(hdr, kMagic);
+    put<uint8_t>(hdr, type);
+    put<uint64_t>(hdr, id);
+    put<uint32_t>(hdr, payload.size());
+    put<uint32_t>(hdr, crc32(payload.data(), payload.size()));
+
+    offset = active->size;
+    if (!write_all(active->fd, hdr.data(), hdr.size()) ||
+        !write_all(active->fd, payload.data(), payload.size())) {
+        LOG_ERRNO("spool write");
+        // Cut off the partial record so later appends stay readable
+        if (ftruncate(active->fd, active->size) < 0) LOG_ERRNO("spool ftruncate");
+        return false;
+    }
+    active->size += hdr.size() + payload.size();
+    ++writtenSeq;
+    flushCv.notify_one();
+    return true;
+}
+
+uint64_t Spool::append(const std::string& sender, const std::vector<std::string>& recipients,
+                       const std::string& raw) {
+    uint64_t id = enqueue(sender, recipients, raw);
+    return (id && waitDurable({id})) ? id : 0;
+}
+
+uint64_t Spool::enqueue(const std::string& sender, const std::vector<std::string>& recipients,
+                        const std::string& raw) {
+    std::string payload = encodeMessage(sender, recipients, raw);
+
+    std::lock_guard<std::mutex> lk(mtx);
+    if (!active || stopping) return 0;
+    uint64_t id = nextId++;
+    uint64_t offset;
+    if (!writeRecord(kTypeMessage, id, payload, offset)) return 0;
+    entries[id] = Entry{active->no, offset, static_cast<uint32_t>(payload.size()), true, writtenSeq, false};
+    liveBySegment[active->no]++;
+    return id;
+}
+
+bool Spool::waitDurable(const std::vector<uint64_t>& ids) {
+    std::unique_lock<std::mutex> lk(mtx);
+    uint64_t target = 0;
+    auto lost = [&] {
+        for (uint64_t id : ids) {
+            auto it = id ? entries.find(id) : entries.end();
+            if (it == entries.end()) continue;
+            if (it->second.lost) return true;
+            target = std::max(target, it->second.seq);
+        }
+        return false;
+    };
+    durableCv.wait(lk, [&] { return lost() || durableSeq >= target || stopping; });
+    return !lost() && durableSeq >= target;
+}
+
+void Spool::markDone(uint64_t id) {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = entries.find(id);
+    if (it == entries.end()) return;
+    liveBySegment[it->second.segment]--;
+    entries.erase(it);
+    // Durability of the done record is not awaited: losing it in a crash
+    // only means the message is replayed once more.
+    uint64_t offset;
+    writeRecord(kTypeDone, id, std::string(), offset);
+    retireSegments();
+}
+
+bool Spool::deadLetter(uint64_t id) {
+    SpoolRecord rec;
+    if (!load(id, rec)) return false;
+    std::string text = "Return-Path: <" + rec.sender + ">\r\n";
+    for (const auto& r : rec.recipients) text += "X-Original-To: " + r + "\r\n";
+    text += rec.raw;
+
+    // Written under a temporary name and renamed, so a crash never leaves a
+    // partial file that looks complete
+    std::string deadDir = dir + "/dead";
+    std::string path = deadDir + "/" + std::to_string(id) + ".eml";
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) { LOG_ERRNO("spool dead-letter open"); return false; }
+    bool ok = write_all(fd, text.data(), text.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        LOG_ERRNO("spool dead-letter write");
+        unlink(tmp.c_str());
+        return false;
+    }
+    int dfd = ::open(deadDir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+    markDone(id);
+    return true;
+}
+
+void Spool::release(uint64_t id) {
+    std::lock_guard<std::mutex> lk(mtx);
+    auto it = entries.find(id);
+    if (it != entries.end()) it->second.inFlight = false;
+}
+
+std::vector<uint64_t> Spool::claimPending(size_t max) {
+    std::vector<uint64_t> ids;
+    std::lock_guard<std::mutex> lk(mtx);
+    for (auto& kv : entries) {
+        if (ids.size() >= max) break;
+        if (kv.second.inFlight) continue;
+        kv.second.inFlight = true;
+        ids.push_back(kv.first);
+    }
+    return ids;
+}
+
+size_t Spool::pendingCount() {
+    std::lock_guard<std::mutex> lk(mtx);
+    return entries.size();
+}
+
+bool Spool::load(uint64_t id, SpoolRecord& out) {
+    Entry e;
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto it = entries.find(id);
+        if (it == entries.end()) return false;
+        e = it->second;
+    }
+    int fd = ::open(segmentPath(e.segment).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { LOG_ERRNO("spool open segment"); return false; }
+    char hdr[kHeaderSize];
+    std::string payload(e.length, '\0');
+    bool ok = read_exact(fd, hdr, kHeaderSize, e.offset) &&
+              (e.length == 0 || read_exact(fd, &payload[0], e.length, e.offset + kHeaderSize));
+    close(fd);
+    if (!ok) return false;
+    uint32_t crc;
+    std::memcpy(&crc, hdr + 17, 4);
+    if (crc32(payload.data(), payload.size()) != crc) return false;
+    out.id = id;
+    return decodeMessage(payload, out);
+}
+
+// Caller holds mtx. Deletes the oldest segments while none of them (nor any
+// older one) holds a pending message; newer done records then refer only to
+// messages that are gone for good.
+void Spool::retireSegments() {
+    while (!liveBySegment.empty()) {
+        auto it = liveBySegment.begin();
+        if (it->second != 0 || (active && it->first == active->no)) break;
+        if (unlink(segmentPath(it->first).c_str()) < 0 && errno != ENOENT) LOG_ERRNO("spool unlink");
+        liveBySegment.erase(it);
+    }
+}
+
+// Group commit: one fdatasync covers every record written since the last one
+void Spool::flushLoop() {
+    std::unique_lock<std::mutex> lk(mtx);
+    while (true) {
+        // After a failed sync nothing is synced until rotate() replaces the segment
+        flushCv.wait(lk, [&] { return stopping || (!failed && writtenSeq > durableSeq); });
+        if (stopping) break;
+        if (fsyncIntervalMs > 0) {
+            // Linger so concurrent writers can join this batch
+            lk.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(fsyncIntervalMs));
+            lk.lock();
+            if (failed) continue;
+        }
+        std::shared_ptr<Segment> seg = active;
+        uint64_t target = writtenSeq;
+        lk.unlock();
+        bool ok = fdatasync(seg->fd) == 0;
+        if (!ok) LOG_ERRNO("spool fdatasync");
+        lk.lock();
+        if (!ok) {
+            syncFailed(seg->no);
+        } else if (target > durableSeq) {
+            durableSeq = target;
+            durableCv.notify_all();
+        }
+    }
+}
@@ -0,0 +1,463 @@
+#include "storage.h"
+#include "logger.h"
+#include "db_pool.h"
+#include "config.h"
+#include "parser.h"
+#include "spool.h"
+#include "lru_cache.h"
+#include "metrics.h"
+#include "worker.h"
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sched.h>
+#include <cerrno>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <cstddef>
+#include <string_view>
+#include <unordered_map>
+#include <pqxx/pqxx>
+
+static std::unique_ptr<BoundedQueue<StorageJob>> g_jobs;
+static int g_jobs_efd = -1;              // non-blocking semaphore eventfd: one count per queued job
+static std::vector<Worker>* g_workers = nullptr;
+
+enum class StoreStatus {
+    Stored,     // committed
+    TempFail,   // database unreachable; worth retrying
+    PermFail    // the message itself could not be stored
+};
+
+static const char* kReplyAccepted = "250 2.0.0 OK: Message accepted";
+
+static const char* reply_for(StoreStatus status) {
+    switch (status) {
+        case StoreStatus::Stored:   return kReplyAccepted;
+        case StoreStatus::TempFail: return "451 4.3.0 Temporary storage failure, try again later";
+        case StoreStatus::PermFail: break;
+    }
+    return "554 5.7.0 Message rejected due to server error";
+}
+
+// Views a string as bytes so libpqxx sends it as a binary-format parameter.
+static std::basic_string_view<std::byte> as_bytes(const std::string& s) {
+    return {reinterpret_cast<const std::byte*>(s.data()), s.size()};
+}
+
+// A parsed message ready to be written, referring to the envelope and raw
+// body it came from (a StorageJob or a SpoolRecord).
+struct PendingMessage {
+    const std::string* sender;
+    const std::vector<std::string>* recipients;
+    const std::string* raw;
+    mail::EmailMessage parsed;
+};
+
+static PendingMessage make_pending(const std::string& sender, const std::vector<std::string>& recipients,
+                                   const std::string& raw) {
+    return PendingMessage{&sender, &recipients, &raw, mail::Parser::parse(raw)};
+}
+
+// Jobs normally arrive parsed by the streaming parser
+static PendingMessage make_pending(StorageJob& job) {
+    if (!job.parsed) return make_pending(job.sender, job.recipients, job.raw);
+    return PendingMessage{&job.sender, &job.recipients, &job.raw, std::move(*job.parsed)};
+}
+
+// Recently stored attachment blobs: content hash -> files.id
+static std::unique_ptr<LruCache<std::string, int>> g_file_ids;
+
+// Maps attachments to files rows inside one transaction. Content is only
+// sent for blobs the database does not already hold; known hashes are
+// answered from the LRU or by a digest-only lookup. Ids learned here are
+// published to the LRU after commit, never before.
+class FileResolver {
+public:
+    explicit FileResolver(PostgresDB& db) : db(db) {}
+
+    int resolve(const mail::BodyPart& att) {
+        auto it = local.find(att.sha256);
+        if (it != local.end()) return it->second;
+
+        int id;
+        if (!g_file_ids->get(att.sha256, id)) {
+            pqxx::result r = db.execute_prepared("file_lookup", as_bytes(att.sha256));
+            if (!r.empty()) {
+                id = db.getInsertedId(r);
+            } else {
+                id = db.getInsertedId(db.execute_prepared(
+                    "file_insert", as_bytes(att.content), as_bytes(att.sha256)));
+            }
+            learned.emplace_back(att.sha256, id);
+        }
+        local.emplace(att.sha256, id);
+        return id;
+    }
+
+    void publish() {
+        for (const auto& kv : learned) g_file_ids->put(kv.first, kv.second);
+    }
+
+private:
+    PostgresDB& db;
+    std::unordered_map<std::string, int> local;
+    std::vector<std::pair<std::string, int>> learned;
+};
+
+// Writes one message in its own transaction.
+static StoreStatus store_message(int affinity, const PendingMessage& m) {
+    const std::string& sender = *m.sender;
+    const std::vector<std::string>& recipients = *m.recipients;
+    const std::string& raw = *m.raw;
+    const mail::EmailMessage& parsedBody = m.parsed;
+
+    // A constraint violation is most likely a cached file id naming a row
+    // that has been deleted since: the second attempt runs with the cache
+    // emptied, so it is never the message's fault.
+    for (int attempt = 0; ; ++attempt) {
+        // Step 1: Use a transaction for atomicity on this thread's pooled connection
+        DbPool::Lease lease;
+        try {
+            lease = g_db_pool->acquire(affinity);
+            PostgresDB& db = lease.db();
+            db.begin();
+
+            // Step 2: Insert the main email data into the 'emails' table.
+            // Parameters travel out of line: recipients as a text[] value and
+            // the raw body in binary format, so nothing is escaped or re-parsed.
+            pqxx::result emailResult = db.execute_prepared(
+                "email_insert",
+                sender,
+                parsedBody.senderName.value_or(""),
+                recipients,
+                as_bytes(raw),
+                parsedBody.subject,
+                parsedBody.plainTextBody.value_or(""),
+                parsedBody.htmlBody.value_or("")
+            );
+            int emailId = db.getInsertedId(emailResult);
+
+            // Step 3: Resolve each attachment to a (possibly shared) files row
+            FileResolver files(db);
+            for (const auto& attachment : parsedBody.attachments) {
+                int fileId = files.resolve(attachment);
+
+                // Step 4: Link the email and the file in the junction table;
+                // the link keeps this message's name and type for the blob
+                db.execute_prepared("email_attachment_link", emailId, fileId,
+                                    attachment.filename, attachment.contentType);
+            }
+
+            db.commit();
+            files.publish();
+            return StoreStatus::Stored;
+
+        } catch (const pqxx::broken_connection& e) {
+            lease.markBroken();
+            LOG_ERROR("Database connection lost: " << e.what());
+            return StoreStatus::TempFail;
+        } catch (const pqxx::integrity_constraint_violation& e) {
+            lease.db().rollback();
+            g_file_ids->clear();
+            if (attempt == 0) {
+                LOG_WARN("Database constraint violation, retrying without cached file ids: " << e.what());
+                continue;
+            }
+            LOG_ERROR("Database transaction failed: " << e.what());
+            return StoreStatus::TempFail;
+        } catch (const std::exception& e) {
+            if (!lease) {
+                // No healthy connection could be leased: ask the client to retry
+                LOG_ERROR("Database unavailable: " << e.what());
+                return StoreStatus::TempFail;
+            }
+            lease.db().rollback();
+            g_file_ids->clear();
+            LOG_ERROR("Database transaction failed: " << e.what());
+            return StoreStatus::PermFail;
+        }
+    }
+}
+
+// Draws `count` ids from the serial sequence behind `table`.id so rows can
+// be streamed with their keys (and foreign keys) already known.
+static std::vector<long long> reserve_ids(pqxx::work& tx, const std::string& table, size_t count) {
+    std::vector<long long> ids;
+    if (count == 0) return ids;
+    ids.reserve(count);
+    pqxx::result r = tx.exec_params(
+        "SELECT nextval(pg_get_serial_sequence($1, 'id')) FROM generate_series(1, $2)",
+        table, static_cast<long long>(count));
+    for (const auto& row : r) ids.push_back(row[0].as<long long>());
+    if (ids.size() != count) throw std::runtime_error("Could not reserve ids for " + table);
+    return ids;
+}
+
+// Writes a whole batch in one transaction with one COPY stream each for
+// emails and email_attachments, so the cost is a handful of round trips
+// plus one upsert per attachment blob the database has not seen yet.
+// All-or-nothing: any failure rolls back every message in the batch.
+static StoreStatus store_batch_copy(int affinity, const std::vector<PendingMessage>& batch) {
+    DbPool::Lease lease;
+    try {
+        lease = g_db_pool->acquire(affinity);
+        PostgresDB& db = lease.db();
+        db.begin();
+        pqxx::work& tx = db.transaction();
+
+        // Attachments first: COPY streams cannot interleave with statements
+        FileResolver files(db);
+        std::vector<std::vector<int>> fileIds(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            for (const auto& att : batch[i].parsed.attachments) fileIds[i].push_back(files.resolve(att));
+        }
+
+        std::vector<long long> emailIds = reserve_ids(tx, "emails", batch.size());
+
+        // COPY quotes column names, so senderName is spelled as Postgres folded it
+        auto emails = pqxx::stream_to::table(tx, {"emails"},
+            {"id", "sender", "sendername", "recipients", "raw_body", "subject", "plain_text_body", "html_body"});
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const PendingMessage& m = batch[i];
+            emails.write_values(emailIds[i], *m.sender, m.parsed.senderName.value_or(""), *m.recipients,
+                                *m.raw, m.parsed.subject, m.parsed.plainTextBody.value_or(""),
+                                m.parsed.htmlBody.value_or(""));
+        }
+        emails.complete();
+
+        auto links = pqxx::stream_to::table(tx, {"email_attachments"},
+            {"email_id", "file_id", "filename", "content_type"});
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const auto& attachments = batch[i].parsed.attachments;
+            for (size_t j = 0; j < attachments.size(); ++j) {
+                links.write_values(emailIds[i], fileIds[i][j], attachments[j].filename,
+                                   attachments[j].contentType);
+            }
+        }
+        links.complete();
+
+        db.commit();
+        files.publish();
+        return StoreStatus::Stored;
+
+    } catch (const pqxx::broken_connection& e) {
+        lease.markBroken();
+        LOG_ERROR("Database connection lost: " << e.what());
+        return StoreStatus::TempFail;
+    } catch (const std::exception& e) {
+        if (!lease) {
+            LOG_ERROR("Database unavailable: " << e.what());
+            return StoreStatus::TempFail;
+        }
+        lease.db().rollback();
+        g_file_ids->clear();
+        LOG_ERROR("Batch insert of " << batch.size() << " messages failed: " << e.what());
+        return StoreStatus::PermFail;
+    }
+}
+
+// Stores a batch, returning one status per message.
+static std::vector<StoreStatus> store_batch(int affinity, const std::vector<PendingMessage>& batch) {
+    if (batch.size() == 1) return {store_message(affinity, batch[0])};
+    StoreStatus status = store_batch_copy(affinity, batch);
+    if (status != StoreStatus::PermFail) return std::vector<StoreStatus>(batch.size(), status);
+
+    // One bad message must not sink the rest: retry them one at a time
+    std::vector<StoreStatus> out;
+    out.reserve(batch.size());
+    for (const auto& m : batch) out.push_back(store_message(affinity, m));
+    return out;
+}
+
+// Hands the reply to the owning worker and wakes its epoll loop.
+static void deliver_ack(const StorageJob& job, std::string reply) {
+    Worker& w = (*g_workers)[job.worker];
+    StorageAck ack{job.fd, job.connId, std::move(reply)};
+    // The ack ring is sized for every job that can be in flight, so this
+    // only spins if a worker is badly behind on draining it.
+    while (!w.acks->try_push(std::move(ack))) sched_yield();
+    uint64_t one = 1;
+    ssize_t n = write(w.evfd, &one, sizeof(one));
+    (void)n;
+}
+
+// Takes the next job, waiting at most timeoutMs (forever if negative).
+static bool next_job(StorageJob& job, int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (true) {
+        uint64_t token;
+        ssize_t n = read(g_jobs_efd, &token, sizeof(token));
+        if (n == sizeof(token)) {
+            // The count is posted after the push completes, but an earlier
+            // producer may still be publishing the slot we are due to take.
+            while (!g_jobs->try_pop(job)) sched_yield();
+            return true;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EAGAIN) { LOG_ERRNO("storage read"); return false; }
+
+        int wait = -1;
+        if (timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) return false;
+            wait = static_cast<int>(left);
+        }
+        pollfd pfd{g_jobs_efd, POLLIN, 0};
+        poll(&pfd, 1, wait);
+    }
+}
+
+// A message the server has answered 250 for is never dropped. When the
+// database refuses it for good it goes to the spool's dead-letter
+// directory; if even that fails it is left to the replay engine.
+static bool dead_letter(uint64_t spoolId) {
+    if (!g_spool->deadLetter(spoolId)) {
+        LOG_ERROR("Spool: could not dead-letter message " << spoolId << ", left for replay");
+        g_spool->release(spoolId);
+        return false;
+    }
+    LOG_ERROR("Spool: message " << spoolId << " refused by the database, moved to the dead-letter directory");
+    metrics::add(metrics::kSpoolDeadLetters);
+    return true;
+}
+
+static void process_jobs(int id, std::vector<StorageJob>& jobs) {
+    // Write-ahead: once a message is in the spool it survives a database
+    // outage or a crash, so it can be accepted either way. The whole batch
+    // shares one fsync.
+    std::vector<uint64_t> spoolIds(jobs.size(), 0);
+    bool durable = false;
+    if (g_spool) {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            spoolIds[i] = g_spool->enqueue(jobs[i].sender, jobs[i].recipients, jobs[i].raw);
+        }
+        durable = g_spool->waitDurable(spoolIds);
+    }
+    bool earlyAck = durable && g_config.storage_ack == AckMode::Spool;
+    if (earlyAck) {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (spoolIds[i]) deliver_ack(jobs[i], kReplyAccepted);
+        }
+    }
+
+    std::vector<PendingMessage> batch;
+    batch.reserve(jobs.size());
+    for (auto& job : jobs) batch.push_back(make_pending(job));
+    std::vector<StoreStatus> statuses = store_batch(id, batch);
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        StoreStatus status = statuses[i];
+        bool acked = earlyAck && spoolIds[i];
+        if (spoolIds[i]) {
+            if (status == StoreStatus::TempFail && durable) {
+                g_spool->release(spoolIds[i]); // left for the replay engine
+                status = StoreStatus::Stored;
+            } else if (status == StoreStatus::PermFail && acked) {
+                dead_letter(spoolIds[i]);
+            } else {
+                // Stored, rejected, or a temporary failure whose record may
+                // not be on disk: then the client gets the 451 and sends the
+                // message again, so the record must not be replayed as well
+                g_spool->markDone(spoolIds[i]);
+            }
+        }
+        if (!acked) deliver_ack(jobs[i], reply_for(status));
+        switch (status) {
+            case StoreStatus::Stored:   metrics::add(metrics::kMessagesAccepted); break;
+            case StoreStatus::TempFail: metrics::add(metrics::kMessagesTempFailed); break;
+            case StoreStatus::PermFail: metrics::add(metrics::kMessagesRejected); break;
+        }
+        charge_buffered((*g_workers)[jobs[i].worker], -static_cast<int64_t>(jobs[i].charged));
+    }
+}
+
+// Collects up to db_batch_max jobs, lingering up to db_batch_linger_ms
+// after the first one so bursts share a transaction.
+static void storage_loop(int id) {
+    size_t batchMax = g_config.db_batch_max > 0 ? g_config.db_batch_max : 1;
+    std::vector<StorageJob> jobs;
+    while (true) {
+        jobs.clear();
+        StorageJob job;
+        if (!next_job(job, -1)) break;
+        jobs.push_back(std::move(job));
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(g_config.db_batch_linger_ms);
+        while (jobs.size() < batchMax) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (!next_job(job, left > 0 ? static_cast<int>(left) : 0)) break;
+            jobs.push_back(std::move(job));
+        }
+        process_jobs(id, jobs);
+    }
+}
+
+// Drains spooled messages that are not yet in the database: everything
+// recovered at startup, plus anything that hit a database outage. Backs off
+// while the database (or the dead-letter directory) keeps failing.
+static void replay_loop(int affinity) {
+    size_t batchMax = g_config.db_batch_max > 0 ? g_config.db_batch_max : 1;
+    while (true) {
+        std::vector<uint64_t> claimed = g_spool->claimPending(batchMax);
+        std::vector<SpoolRecord> records;
+        records.reserve(claimed.size());
+        for (uint64_t spoolId : claimed) {
+            SpoolRecord rec;
+            if (!g_spool->load(spoolId, rec)) {
+                LOG_ERROR("Spool: unreadable message " << spoolId << ", discarding");
+                g_spool->markDone(spoolId);
+                continue;
+            }
+            records.push_back(std::move(rec));
+        }
+
+        bool backOff = false;
+        if (!records.empty()) {
+            std::vector<PendingMessage> batch;
+            batch.reserve(records.size());
+            for (const auto& rec : records) batch.push_back(make_pending(rec.sender, rec.recipients, rec.raw));
+            std::vector<StoreStatus> statuses = store_batch(affinity, batch);
+            for (size_t i = 0; i < records.size(); ++i) {
+                if (statuses[i] == StoreStatus::TempFail) {
+                    g_spool->release(records[i].id);
+                    backOff = true;
+                } else if (statuses[i] == StoreStatus::PermFail) {
+                    // Spooled messages may all have been answered 250
+                    if (!dead_letter(records[i].id)) backOff = true;
+                } else {
+                    g_spool->markDone(records[i].id);
+                }
+            }
+        }
+        if (claimed.empty() || backOff) {
+            std::this_thread::sleep_for(std::chrono::seconds(g_config.spool_replay_secs));
+        }
+    }
+}
+
+void storage_start(std::vector<Worker>& workers) {
+    g_workers = &workers;
+    g_jobs = std::make_unique<BoundedQueue<StorageJob>>(g_config.storage_queue_size);
+    g_file_ids = std::make_unique<LruCache<std::string, int>>(g_config.attachment_cache_size);
+    g_jobs_efd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+    if (g_jobs_efd < 0) { LOG_ERRNO("eventfd"); return; }
+
+    int threads = g_config.storage_threads > 0 ? g_config.storage_threads : 1;
+    for (int i = 0; i < threads; ++i) {
+        std::thread(storage_loop, i).detach();
+    }
+    if (g_spool) std::thread(replay_loop, threads).detach();
+}
+
+bool storage_submit(StorageJob&& job) {
+    if (!g_jobs->try_push(std::move(job))) return false;
+    uint64_t one = 1;
+    ssize_t n = write(g_jobs_efd, &one, sizeof(one));
+    (void)n;
+    return true;
+}
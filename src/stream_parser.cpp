@@ -0,0 +1,215 @@
+// stream_parser.cpp
+#include "stream_parser.h"
+#include "mime_codec.h"
+#include <cctype>
+#include <cstring>
+
+namespace mail {
+
+StreamParser::StreamParser() {
+    stack.emplace_back();
+}
+
+void StreamParser::feed(const char* data, size_t len) {
+    while (len > 0) {
+        const char* nl = static_cast<const char*>(std::memchr(data, '\n', len));
+        if (!nl) {
+            partial.append(data, len);
+            return;
+        }
+        size_t n = nl - data;
+        if (partial.empty()) {
+            feedLine(data, (n > 0 && data[n - 1] == '\r') ? n - 1 : n);
+        } else {
+            partial.append(data, n);
+            if (!partial.empty() && partial.back() == '\r') partial.pop_back();
+            feedLine(partial.data(), partial.size());
+            partial.clear();
+        }
+        data += n + 1;
+        len -= n + 1;
+    }
+}
+
+void StreamParser::feedLine(const char* p, size_t n) {
+    if (n >= 2 && p[0] == '-' && p[1] == '-' && onBoundary(p, n)) return;
+
+    Entity& e = stack.back();
+    if (e.stage == Stage::Headers) {
+        onHeaderLine(e, p, n);
+        return;
+    }
+    switch (e.sink) {
+        case Sink::Plain:
+        case Sink::Html:
+        case Sink::Attachment:
+            appendLeaf(e, p, n);
+            break;
+        case Sink::Multipart:  // preamble or epilogue
+        case Sink::None:
+            break;
+    }
+}
+
+// Handles a "--boundary" or "--boundary--" line for any open multipart.
+// Outer boundaries are honoured too, closing inner parts left unterminated.
+bool StreamParser::onBoundary(const char* p, size_t n) {
+    for (size_t i = stack.size(); i-- > 0;) {
+        Entity& mp = stack[i];
+        if (mp.sink != Sink::Multipart || mp.ended || mp.stage != Stage::Body) continue;
+        const std::string& b = mp.boundary;
+        if (n < 2 + b.size() || std::memcmp(p + 2, b.data(), b.size()) != 0) continue;
+
+        bool close = n >= 4 + b.size() && p[2 + b.size()] == '-' && p[3 + b.size()] == '-';
+        while (stack.size() > i + 1) closeTop();
+        if (close) stack[i].ended = true;
+        else stack.emplace_back(); // next part starts with its headers
+        return true;
+    }
+    return false;
+}
+
+void StreamParser::onHeaderLine(Entity& e, const char* p, size_t n) {
+    if (n > 0) {
+        e.headerBlock.append(p, n);
+        e.headerBlock.push_back('\n');
+        return;
+    }
+    if (e.headerBlock.empty() && stack.size() > 1) {
+        // Part without headers: skipped, as Parser::parse does
+        e.stage = Stage::Body;
+        e.sink = Sink::None;
+        return;
+    }
+    startBody(e);
+}
+
+// Headers complete: decide where the body goes
+void StreamParser::startBody(Entity& e) {
+    e.stage = Stage::Body;
+    HeaderTable hdrs;
+    parseHeaderBlock(e.headerBlock, hdrs);
+
+    if (stack.size() == 1) {
+        msg.from = Parser::headerValue(hdrs, "from");
+        msg.senderName = Parser::extractSenderName(msg.from);
+        msg.to = Parser::headerValue(hdrs, "to");
+        msg.cc = Parser::headerValue(hdrs, "cc");
+        msg.subject = Parser::headerValue(hdrs, "subject");
+        msg.date = Parser::headerValue(hdrs, "date");
+        msg.messageId = Parser::headerValue(hdrs, "message-id");
+    }
+
+    std::string ct = Parser::headerValue(hdrs, "content-type");
+    e.ctype = hdrs.has("content-type") ? Parser::trim(Parser::toLower(ct)) : "text/plain";
+    e.encoding = hdrs.has("content-transfer-encoding")
+        ? Parser::toLower(Parser::trim(Parser::headerValue(hdrs, "content-transfer-encoding"))) : "7bit";
+    std::string disposition = Parser::headerValue(hdrs, "content-disposition");
+    // hdrs points into headerBlock; nothing below reads it
+    e.headerBlock.clear();
+    e.headerBlock.shrink_to_fit();
+
+    if (e.ctype.find("multipart/") != std::string::npos) {
+        std::string boundary = Parser::extractParameter(ct, "boundary");
+        if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"') {
+            boundary = boundary.substr(1, boundary.size() - 2);
+        }
+        if (!boundary.empty()) {
+            e.sink = Sink::Multipart;
+            e.boundary = boundary;
+            return;
+        }
+        // No boundary: treat as plain text
+        e.sink = msg.plainTextBody.has_value() ? Sink::None : Sink::Plain;
+        return;
+    }
+
+    if (e.ctype.find("text/plain") != std::string::npos) {
+        // Only the first text/plain part is kept; don't decode the rest
+        e.sink = msg.plainTextBody.has_value() ? Sink::None : Sink::Plain;
+    } else if (e.ctype.find("text/html") != std::string::npos) {
+        e.sink = msg.htmlBody.has_value() ? Sink::None : Sink::Html;
+    } else {
+        e.sink = Sink::Attachment;
+        e.filename = Parser::attachmentFilename(disposition, e.ctype);
+    }
+}
+
+void StreamParser::appendLeaf(Entity& e, const char* p, size_t n) {
+    size_t before = e.out.size();
+
+    if (e.encoding == "base64") {
+        // Bits carry across lines, so line breaks need no special handling
+        base64Decode(p, n, e.out, e.b64);
+    } else {
+        // Leading and trailing blank lines are trimmed, as Parser::parse
+        // does: a line break is only written once more content follows
+        if (n == 0) {
+            if (e.started) ++e.pendingNewlines;
+            return;
+        }
+        e.started = true;
+        e.out.append(e.pendingNewlines, '\n');
+        e.pendingNewlines = 1;
+
+        if (e.encoding == "quoted-printable") {
+            size_t end = n;
+            if (end > 0 && p[end - 1] == '=') { --end; e.pendingNewlines = 0; } // soft line break
+            qpDecode(p, end, e.out);
+        } else {
+            e.out.append(p, n);
+        }
+    }
+
+    if (e.sink == Sink::Attachment) e.hash.update(e.out.data() + before, e.out.size() - before);
+}
+
+// Finishes the innermost entity and hands its content to the message
+void StreamParser::closeTop() {
+    Entity& e = stack.back();
+    if (e.stage == Stage::Headers && !(stack.size() > 1 && e.headerBlock.empty())) startBody(e);
+
+    switch (e.sink) {
+        case Sink::Plain:
+            if (!msg.plainTextBody.has_value()) msg.plainTextBody = std::move(e.out);
+            break;
+        case Sink::Html:
+            if (!msg.htmlBody.has_value()) msg.htmlBody = std::move(e.out);
+            break;
+        case Sink::Attachment: {
+            BodyPart att;
+            att.sha256 = e.hash.digest();
+            att.content = std::move(e.out);
+            att.contentType = e.ctype;
+            att.filename = std::move(e.filename);
+            msg.attachments.push_back(std::move(att));
+            break;
+        }
+        case Sink::Multipart:
+        case Sink::None:
+            break;
+    }
+    stack.pop_back();
+}
+
+EmailMessage StreamParser::finish() {
+    if (!partial.empty()) {
+        std::string last;
+        last.swap(partial);
+        feedLine(last.data(), last.size());
+    }
+    while (!stack.empty()) closeTop();
+    stack.emplace_back(); // parser can be reused
+    EmailMessage out = std::move(msg);
+    msg = EmailMessage();
+    return out;
+}
+
+void StreamParser::reset() {
+    stack.clear();
+    stack.emplace_back();
+    partial.clear();
+    msg = EmailMessage();
+}
+
+} // namespace mail
@@ -18,19 +18,19 @@ std::string getEmailDomain(const std::string& email) {
     return ""; // invalid email
 }
 
-std::string extract_sender(const std::string& line) {
+std::string extract_sender(std::string_view line) {
     // Find start of "<"
     size_t start = line.find('<');
     // Find end of ">"
     size_t end = line.find('>', start);
 
-    if (start != std::string::npos && end != std::string::npos && end > start) {
-        return line.substr(start + 1, end - start - 1); // sender inside <>
+    if (start != std::string_view::npos && end != std::string_view::npos && end > start) {
+        return std::string(line.substr(start + 1, end - start - 1)); // sender inside <>
     }
 
     // fallback: try after "MAIL FROM:"
     if (line.size() > 10) {
-        std::string fallback = line.substr(10);
+        std::string fallback(line.substr(10));
         // trim leading/trailing spaces
         fallback.erase(0, fallback.find_first_not_of(" \t\r\n"));
         fallback.erase(fallback.find_last_not_of(" \t\r\n") + 1);
@@ -40,6 +40,39 @@ std::string extract_sender(const std::string& line) {
     return "";
 }
 
+std::string_view extract_mail_param(std::string_view line, std::string_view key) {
+    // Parameters follow the closing '>' of the reverse-path, separated by spaces
+    size_t pos = line.find('>');
+    if (pos == std::string_view::npos) return {};
+    while (pos < line.size()) {
+        size_t start = line.find_first_not_of(' ', pos + 1);
+        if (start == std::string_view::npos) break;
+        size_t end = line.find(' ', start);
+        std::string_view param = line.substr(start, end == std::string_view::npos ? end : end - start);
+        size_t eq = param.find('=');
+        std::string_view name = param.substr(0, eq);
+        bool match = name.size() == key.size();
+        for (size_t i = 0; i < key.size() && match; ++i)
+            match = std::toupper(static_cast<unsigned char>(name[i])) == std::toupper(static_cast<unsigned char>(key[i]));
+        if (match) return eq == std::string_view::npos ? std::string_view() : param.substr(eq + 1);
+        if (end == std::string_view::npos) break;
+        pos = end;
+    }
+    return {};
+}
+
+long long extract_size_param(std::string_view line) {
+    std::string_view value = extract_mail_param(line, "SIZE");
+    if (value.empty()) return -1;
+    long long size = 0;
+    for (char c : value) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) return -1;
+        if (size > (1LL << 50)) return size; // absurdly large; no need to keep counting
+        size = size * 10 + (c - '0');
+    }
+    return size;
+}
+
     void rstrip_crlf(std::string& s) {
     while (!s.empty() && (s.back() == '\r' || s.back() == '\n')) s.pop_back();
 }
\ No newline at end of file
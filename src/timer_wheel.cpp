@@ -0,0 +1,104 @@
+#include "timer_wheel.h"
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick)
+    : origin(Clock::now()), tick(tick) {
+    for (auto& level : heads) std::fill(std::begin(level), std::end(level), -1);
+}
+
+uint64_t TimerWheel::tickOf(Clock::time_point t) const {
+    if (t <= origin) return 0;
+    return static_cast<uint64_t>((t - origin) / tick);
+}
+
+int TimerWheel::msUntilNextDeadline(Clock::time_point now) const {
+    if (count == 0) return -1;
+    // Every timer in a slot comes due (level 0) or cascades (upper levels) on
+    // the same tick, so the head of each non-empty slot is enough
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < kLevels; ++level) {
+        int shift = kBits * level;
+        for (int slot = 0; slot < kSlots; ++slot) {
+            int id = heads[level][slot];
+            if (id < 0) continue;
+            uint64_t due = nodes[id].due;
+            next = std::min(next, level == 0 ? due : (due >> shift) << shift);
+        }
+    }
+    next = std::max(next, cur + 1);
+    auto at = origin + tick * static_cast<int64_t>(next);
+    if (at <= now) return 0;
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(at - now).count();
+    return static_cast<int>(std::min<int64_t>(ms, INT_MAX));
+}
+
+void TimerWheel::arm(int id, Clock::time_point deadline) {
+    if (id < 0) return;
+    if (static_cast<size_t>(id) >= nodes.size()) nodes.resize(static_cast<size_t>(id) + 1);
+    Node& n = nodes[id];
+    // Round up so a timer never fires early; never file in the past
+    uint64_t when = std::max(tickOf(deadline) + 1, cur + 1);
+    if (n.level >= 0 && when >= n.due) {
+        n.deadline = when; // later than filed: refiled lazily
+        return;
+    }
+    if (n.level >= 0) unlink(id);
+    n.deadline = when;
+    file(id);
+}
+
+void TimerWheel::cancel(int id) {
+    if (id < 0 || static_cast<size_t>(id) >= nodes.size() || nodes[id].level < 0) return;
+    unlink(id);
+}
+
+// Files a node under the slot its deadline falls in at the coarsest level
+// that still separates it from the current tick. A node cascaded down on
+// its own deadline tick lands in the level-0 slot expire() is about to run.
+void TimerWheel::file(int id) {
+    Node& n = nodes[id];
+    uint64_t when = std::max(n.deadline, cur);
+    uint64_t delta = when - cur;
+    int level = 0;
+    while (level < kLevels - 1 && delta >= (uint64_t(1) << (kBits * (level + 1)))) ++level;
+    if (level == kLevels - 1) {
+        // Beyond the wheel's span: park in the farthest slot and refile later
+        uint64_t span = uint64_t(1) << (kBits * kLevels);
+        if (delta >= span) when = cur + span - 1;
+    }
+    int slot = static_cast<int>((when >> (kBits * level)) & kMask);
+    n.level = level;
+    n.slot = slot;
+    n.due = when;
+    n.prev = -1;
+    n.next = heads[level][slot];
+    if (n.next >= 0) nodes[n.next].prev = id;
+    heads[level][slot] = id;
+    ++count;
+}
+
+void TimerWheel::unlink(int id) {
+    Node& n = nodes[id];
+    if (n.prev >= 0) nodes[n.prev].next = n.next;
+    else heads[n.level][n.slot] = n.next;
+    if (n.next >= 0) nodes[n.next].prev = n.prev;
+    n.prev = n.next = -1;
+    n.level = -1;
+    --count;
+}
+
+// When a level completes a turn, the next level's current slot is spread
+// over the levels below
+void TimerWheel::cascade() {
+    for (int level = 1; level < kLevels; ++level) {
+        if ((cur & ((uint64_t(1) << (kBits * level)) - 1)) != 0) return;
+        int slot = static_cast<int>((cur >> (kBits * level)) & kMask);
+        int id;
+        while ((id = heads[level][slot]) >= 0) {
+            unlink(id);
+            file(id);
+        }
+    }
+}
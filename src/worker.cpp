@@ -1,56 +1,459 @@
 #include "worker.h"
+#include "logger.h"
 #include "string_manipulation.h"
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <iostream>
 #include <cerrno>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <string_view>
 #include <types.h>
 #include <config.h>
 #include <fcntl.h>
+#include "dispatch.h"
+#include "io_uring_loop.h"
+#include "metrics.h"
+
+// Buffered bytes (ConnState::bufferedBytes) summed over every worker
+static std::atomic<int64_t> g_buffered_total{0};
+
+bool memory_over_budget() {
+    if (g_config.memory_budget_mb <= 0) return false;
+    return g_buffered_total.load(std::memory_order_relaxed) > (static_cast<int64_t>(g_config.memory_budget_mb) << 20);
+}
+
+void charge_buffered(Worker& w, int64_t delta) {
+    w.load.buffered.fetch_add(delta, std::memory_order_relaxed);
+    g_buffered_total.fetch_add(delta, std::memory_order_relaxed);
+}
+
+static void account_buffered(Worker& w, ConnState& st, size_t held) {
+    int64_t delta = static_cast<int64_t>(held) - static_cast<int64_t>(st.bufferedBytes);
+    if (delta == 0) return;
+    charge_buffered(w, delta);
+    st.bufferedBytes = held;
+}
+
+// Runs every complete line in st.inbuf through the SMTP state machine;
+// message text during DATA is taken in bulk by consume_data.
+// Stops early while a DATA handoff awaits its storage ack or a MAIL FROM
+// its SPF verdict; pipelined commands stay buffered until the reply has
+// been sent.
+static void process_buffered_lines(Worker& w, ConnState& st, int fd) {
+    size_t pos = 0;
+    while (!st.paused()) {
+        if (st.skipLine) {
+            size_t eol = st.inbuf.find('\n', pos);
+            if (eol == std::string::npos) { pos = st.inbuf.size(); break; }
+            pos = eol + 1;
+            st.skipLine = false;
+            continue;
+        }
+        if (st.chunkRemaining > 0) {
+            size_t used = consume_chunk(w, st, fd, st.inbuf.data() + pos, st.inbuf.size() - pos);
+            if (used == 0) break;
+            pos += used;
+            continue;
+        }
+        if (st.inData) {
+            size_t used = consume_data(w, st, fd, st.inbuf.data() + pos, st.inbuf.size() - pos);
+            if (used == 0) break;
+            pos += used;
+            continue;
+        }
+        size_t eol = st.inbuf.find('\n', pos);
+        if (eol == std::string::npos) break;
+        // A view into inbuf: the line is not copied, and inbuf is left
+        // alone until the loop ends
+        std::string_view line(st.inbuf.data() + pos, eol - pos + 1);
+        pos = eol + 1;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.remove_suffix(1);
+        LOG_PROTOCOL("C: " << line);
+        process_smtp_line(w, st, fd, line);
+    }
+    // A partial line this long will not turn into a valid one; drop it
+    // (and the rest of it as it arrives) instead of buffering without bound.
+    // While paused, the rest may be whole commands still to run: input_full
+    // bounds it instead.
+    if (!st.paused() && st.inbuf.size() - pos > ConnState::kMaxLineLength) {
+        if (st.inData) {
+            // The message is refused once its terminator arrives
+            st.longLine = true;
+            std::string().swap(st.dataBuffer);
+        } else {
+            send_line(st, "500 5.5.2 Line too long");
+        }
+        st.skipLine = true;
+        pos = st.inbuf.size();
+    }
+    st.inbuf.erase(0, pos);
+
+    // Publish how much this session now holds
+    account_buffered(w, st, st.inbuf.size() + st.dataBuffer.size());
+}
+
+void close_connection(Worker& w, int fd) {
+    if (w.ring) {
+        uring_close(w, fd);
+    } else {
+        epoll_ctl(w.epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+    }
+    w.timers.cancel(fd);
+    ConnState* st = w.conns.find(fd);
+    if (!st) return;
+    account_buffered(w, *st, 0);
+    w.load.conns.fetch_sub(1, std::memory_order_relaxed);
+    w.conns.release(fd);
+}
+
+// Writes the replies queued in st.outbuf with as few send() calls as the
+// socket allows. Whatever does not fit waits for EPOLLOUT. Under io_uring
+// the whole batch becomes one send request, and replies queued while it is
+// in flight go out together when it completes. Returns false if the
+// connection was closed (write error, or QUIT fully answered).
+static bool flush_output(Worker& w, ConnState& st, int fd) {
+    if (w.ring) {
+        if (!st.wantWrite && !st.outbuf.empty()) {
+            uring_send(w, fd, st.outbuf);
+            st.wantWrite = true;
+        }
+        if (st.closing && !st.wantWrite && st.outbuf.empty()) {
+            close_connection(w, fd);
+            return false;
+        }
+        return true;
+    }
+    size_t sent = 0;
+    while (sent < st.outbuf.size()) {
+        ssize_t n = send(fd, st.outbuf.data() + sent, st.outbuf.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) { sent += static_cast<size_t>(n); continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        close_connection(w, fd);
+        return false;
+    }
+    st.outbuf.erase(0, sent);
+
+    bool want = !st.outbuf.empty();
+    if (want != st.wantWrite) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET | (want ? EPOLLOUT : 0);
+        ev.data.fd = fd;
+        epoll_ctl(w.epfd, EPOLL_CTL_MOD, fd, &ev);
+        st.wantWrite = want;
+    }
+    if (!want && st.closing) {
+        close_connection(w, fd);
+        return false;
+    }
+    return true;
+}
+
+// Runs buffered commands and flushes their replies, going round again when
+// a full output buffer was all that held commands back. False if the
+// connection was closed.
+static bool serve(Worker& w, ConnState& st, int fd) {
+    while (true) {
+        process_buffered_lines(w, st, fd);
+        bool output_bound = st.outbuf.size() >= ConnState::kMaxPendingOutput;
+        if (!flush_output(w, st, fd)) return false;
+        if (!output_bound || !st.outbuf.empty()) return true;
+    }
+}
+
+// The timeout that applies to what the session is waiting for next
+static int session_timeout(const ConnState& st) {
+    if (st.transferring()) return g_config.data_timeout_secs;
+    if (!st.helo) return g_config.greeting_timeout_secs;
+    if (!st.sender.empty()) return g_config.command_timeout_secs;
+    return g_config.idle_timeout_secs;
+}
+
+// Restarts the session's timeout; called whenever the client makes progress
+static void arm_timeout(Worker& w, const ConnState& st, int fd) {
+    int secs = session_timeout(st);
+    if (secs > 0) w.timers.arm(fd, w.now + std::chrono::seconds(secs));
+    else w.timers.cancel(fd);
+}
+
+// Timer wheel callback: closes a session whose client went quiet
+static void expire_session(Worker& w, int fd) {
+    ConnState* st = w.conns.find(fd);
+    if (!st) return;
+    // Waiting on this server (storage, SPF, memory budget), not on the client
+    if (st->awaitingStorage || st->awaitingSpf || st->throttled) {
+        arm_timeout(w, *st, fd);
+        return;
+    }
+    LOG_INFO("Timeout, closing connection from " << st->ip);
+    metrics::add(metrics::kConnectionsTimedOut);
+    send_line(*st, "421 4.4.2 mx.distyn.com Error: timeout exceeded");
+    st->closing = true;
+    // Best effort: a client that stopped reading does not get to hold the slot
+    if (flush_output(w, *st, fd)) close_connection(w, fd);
+}
+
+// Connection ids are unique across workers, so a late storage ack or SPF
+// verdict can never match a newer connection that reused the fd.
+static std::atomic<uint64_t> g_next_conn_id{1};
+
+// Creates the state for a new connection owned by `w` and starts the session
+void register_connection(Worker& w, int cfd, const std::string& ip) {
+    ConnState& st = w.conns.open(cfd, g_next_conn_id.fetch_add(1, std::memory_order_relaxed));
+    st.ip = ip;
+    send_line(st, "220 mx.distyn.com ESMTP PigeonX");
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET; // edge-triggered for efficiency
+    ev.data.fd = cfd;
+    if (w.ring) {
+        uring_watch(w, cfd);
+    } else if (epoll_ctl(w.epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+        LOG_ERRNO("epoll_ctl ADD");
+        w.conns.release(cfd);
+        close(cfd);
+        return;
+    }
+    w.load.conns.fetch_add(1, std::memory_order_relaxed);
+    metrics::add(metrics::kConnectionsAccepted);
+    arm_timeout(w, st, cfd);
+    flush_output(w, st, cfd);
+}
+
+void accept_connections(Worker& w) {
+    while (true) {
+        sockaddr_in cli{};
+        socklen_t len = sizeof(cli);
+        int cfd = accept4(w.listenFd, (sockaddr*)&cli, &len, SOCK_NONBLOCK);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN: drained (another worker may have taken the rest).
+            // EMFILE and friends: leave the rest queued for the next wakeup.
+            if (errno != EAGAIN && errno != EWOULDBLOCK) LOG_ERRNO("accept");
+            break;
+        }
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(cli.sin_addr), ip_str, INET_ADDRSTRLEN);
+        take_connection(w, cfd, ip_str);
+    }
+}
+
+void take_connection(Worker& w, int cfd, const std::string& ip) {
+    // Pass it on if the dispatch policy finds a less loaded worker
+    Worker& target = pick_worker(&w);
+    if (&target != &w && hand_off(target, cfd, ip)) return;
+    register_connection(w, cfd, ip);
+}
+
+bool hand_off(Worker& w, int fd, const std::string& ip) {
+    if (!w.incoming->try_push(Handoff{fd, ip})) return false;
+    w.load.queued.fetch_add(1, std::memory_order_relaxed);
+    uint64_t one = 1;
+    ssize_t n = write(w.evfd, &one, sizeof(one));
+    (void)n;
+    return true;
+}
+
+void adopt_connections(Worker& w) {
+    Handoff h;
+    while (w.incoming->try_pop(h)) {
+        w.load.queued.fetch_sub(1, std::memory_order_relaxed);
+        register_connection(w, h.fd, h.ip);
+    }
+}
+
+// Over the memory budget only transfers already under way keep going, so
+// the memory they hold is released when they finish. True if the session
+// must stop reading.
+static bool throttle(Worker& w, ConnState& st, int fd) {
+    if (st.transferring() || !memory_over_budget()) return false;
+    if (!st.throttled) {
+        st.throttled = true;
+        w.throttled.emplace_back(fd, st.id);
+    }
+    return true;
+}
+
+// Input is not consumed while the session is paused (waiting for storage,
+// SPF or the client to read its replies), so reading stops once it holds
+// kMaxPausedInput; the socket buffer and TCP flow control hold the rest.
+// Under io_uring, receives that completed before the cancel took effect
+// still arrive, at most uring_buffers * buf_sz per worker. True if the
+// session must stop reading.
+static bool input_full(ConnState& st) {
+    if (!st.paused() || st.inbuf.size() <= ConnState::kMaxPausedInput) return false;
+    st.inputFull = true;
+    return true;
+}
+
+// Reads again from a session stopped by input_full once its buffered
+// commands have run. A throttled one is left to resume_throttled.
+static void resume_input(Worker& w, ConnState& st, int fd) {
+    if (!st.inputFull || st.paused()) return;
+    st.inputFull = false;
+    if (!st.throttled) handle_readable(w, fd);
+}
+
+// Peer done sending; answer what it pipelined, then close
+static void peer_closed(Worker& w, ConnState& st, int fd) {
+    if (!serve(w, st, fd)) return;
+    if (st.outbuf.empty() && !st.wantWrite) close_connection(w, fd);
+    else st.closing = true;
+}
 
 void handle_readable(Worker& w, int fd) {
-    char buf[g_config.buf_sz];
+    ConnState* stp = w.conns.find(fd);
+    if (!stp) return;
+    ConnState& st = *stp;
+    // io_uring receives on its own; this only restarts a throttled session
+    if (w.ring) {
+        uring_watch(w, fd);
+        if (serve(w, st, fd)) arm_timeout(w, st, fd);
+        return;
+    }
+    metrics::Timer timer(metrics::kReadBatch);
+    std::vector<char>& buf = w.recvBuf;
     while (true) {
-        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (throttle(w, st, fd)) break;
+        if (input_full(st)) {
+            // Flushing replies may unpause the session; if it does, what
+            // is still unread must be read now: the edge will not come again
+            if (!serve(w, st, fd)) return;
+            if (st.paused()) break;
+            st.inputFull = false;
+        }
+        ssize_t n = recv(fd, buf.data(), buf.size(), 0);
         if (n > 0) {
-            auto& st = w.conns[fd];
-            st.inbuf.append(buf, buf + n);
-            size_t pos = 0;
-            while (true) {
-                size_t eol = st.inbuf.find('\n', pos);
-                if (eol == std::string::npos) { st.inbuf.erase(0, pos); break; }
-                std::string line = w.conns[fd].inbuf.substr(pos, eol - pos + 1);
-                pos = eol + 1;
-                std::string log_line = line;
-                rstrip_crlf(log_line);
-                std::cout << "C: " << log_line << std::endl;
-                process_smtp_line(st, fd, line);
-            }
+            metrics::add(metrics::kBytesReceived, static_cast<uint64_t>(n));
+            st.inbuf.append(buf.data(), static_cast<size_t>(n));
+            process_buffered_lines(w, st, fd);
         } else if (n == 0) {
-            epoll_ctl(w.epfd, EPOLL_CTL_DEL, fd, nullptr);
-            close(fd);
-            w.conns.erase(fd);
-            break;
+            peer_closed(w, st, fd);
+            return;
         } else {
+            if (errno == EINTR) continue;
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            else { epoll_ctl(w.epfd, EPOLL_CTL_DEL, fd, nullptr); close(fd); w.conns.erase(fd); break; }
+            else { close_connection(w, fd); return; }
         }
     }
+    // All replies to this read batch go out together
+    if (serve(w, st, fd)) arm_timeout(w, st, fd);
+}
+
+void handle_received(Worker& w, int fd, const char* data, size_t len) {
+    ConnState* stp = w.conns.find(fd);
+    if (!stp) return;
+    ConnState& st = *stp;
+    if (len == 0) { peer_closed(w, st, fd); return; }
+    metrics::Timer timer(metrics::kReadBatch);
+    metrics::add(metrics::kBytesReceived, len);
+    st.inbuf.append(data, len);
+    // Over the memory budget or input_full, bytes already received wait in
+    // inbuf like unread ones wait in the socket under epoll
+    bool paused = st.throttled || st.inputFull;
+    if (throttle(w, st, fd) || input_full(st)) {
+        if (!paused) uring_pause_reads(w, fd);
+        return;
+    }
+    if (serve(w, st, fd)) arm_timeout(w, st, fd);
+}
+
+void handle_writable(Worker& w, int fd) {
+    ConnState* stp = w.conns.find(fd);
+    if (!stp) return;
+    ConnState& st = *stp;
+    if (!flush_output(w, st, fd)) return;
+    arm_timeout(w, st, fd);
+    if (!st.outbuf.empty()) return;
+    // Drained: run commands held back by a full output buffer
+    if (serve(w, st, fd)) resume_input(w, st, fd);
+}
+
+void handle_storage_acks(Worker& w) {
+    uint64_t count;
+    ssize_t n = read(w.evfd, &count, sizeof(count)); // reset the eventfd counter
+    (void)n;
+    StorageAck ack;
+    while (w.acks->try_pop(ack)) {
+        w.load.pending.fetch_sub(1, std::memory_order_relaxed);
+        ConnState* stp = w.conns.find(ack.fd);
+        // Connection closed (and fd possibly reused) while the job was in flight
+        if (!stp || stp->id != ack.connId) continue;
+        ConnState& st = *stp;
+        send_line(st, ack.reply);
+        st.awaitingStorage = false;
+        if (!serve(w, st, ack.fd)) continue;
+        arm_timeout(w, st, ack.fd);
+        resume_input(w, st, ack.fd);
+    }
+}
+
+void handle_spf_verdicts(Worker& w) {
+    SpfVerdict verdict;
+    while (w.spfVerdicts->try_pop(verdict)) {
+        w.load.pending.fetch_sub(1, std::memory_order_relaxed);
+        ConnState* stp = w.conns.find(verdict.fd);
+        if (!stp || stp->id != verdict.connId) continue;
+        ConnState& st = *stp;
+        finish_mail_from(st, verdict.fd, verdict);
+        if (!serve(w, st, verdict.fd)) continue;
+        arm_timeout(w, st, verdict.fd);
+        resume_input(w, st, verdict.fd);
+    }
+}
+
+// Reads again from sessions paused by the memory budget once usage is back
+// under it. Their data may have arrived long ago, so edge-triggered epoll
+// will not report them again.
+static void resume_throttled(Worker& w) {
+    if (w.throttled.empty() || memory_over_budget()) return;
+    std::vector<std::pair<int, uint64_t>> paused;
+    paused.swap(w.throttled);
+    for (const auto& [fd, id] : paused) {
+        ConnState* st = w.conns.find(fd);
+        if (!st || st->id != id) continue;
+        st->throttled = false;
+        handle_readable(w, fd);
+    }
+}
+
+int next_wakeup_ms(const Worker& w) {
+    // Sleep until the earliest session deadline, and poll while sessions
+    // wait for memory to free up
+    int timeout = w.timers.msUntilNextDeadline(TimerWheel::Clock::now());
+    if (!w.throttled.empty() && (timeout < 0 || timeout > 10)) timeout = 10;
+    return timeout;
+}
+
+void end_of_batch(Worker& w) {
+    resume_throttled(w);
+    w.timers.expire(w.now, [&w](int fd) { expire_session(w, fd); });
 }
 
 void worker_loop(Worker* wptr, int id) {
     Worker& w = *wptr;
+    w.recvBuf.resize(g_config.buf_sz);
     std::vector<epoll_event> events(g_config.max_events);
+    w.now = TimerWheel::Clock::now();
     while (true) {
-        int n = epoll_wait(w.epfd, events.data(), g_config.max_events, -1);
-        if (n < 0) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
+        int n = epoll_wait(w.epfd, events.data(), g_config.max_events, next_wakeup_ms(w));
+        if (n < 0) { if (errno == EINTR) continue; LOG_ERRNO("epoll_wait"); break; }
+        w.now = TimerWheel::Clock::now();
         for (int i = 0; i < n; ++i) {
             int fd = events[i].data.fd;
             uint32_t ev = events[i].events;
-            if (ev & (EPOLLHUP | EPOLLERR)) { epoll_ctl(w.epfd, EPOLL_CTL_DEL, fd, nullptr); close(fd); w.conns.erase(fd); continue; }
+            if (fd == w.evfd) { handle_storage_acks(w); handle_spf_verdicts(w); adopt_connections(w); continue; }
+            if (fd == w.listenFd) { accept_connections(w); continue; }
+            if (ev & (EPOLLHUP | EPOLLERR)) { close_connection(w, fd); continue; }
             if (ev & EPOLLIN) handle_readable(w, fd);
+            if (ev & EPOLLOUT) handle_writable(w, fd);
         }
+        end_of_batch(w);
     }
 }
 